@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "interpolate.h"
+#include "stepper.h"
+#include "corner.h"
+#include "bytecodes.h"
+
+//
+// microbenchmarks for the profile and step timing kernels: segment
+// setup (setseg, stepper_set_parms, profile_solve one at a time and
+// in a batch), time at a distance (time2alpha
+// in double, time_at_l in float), the corner cosine and the delay
+// encoder, each timed on its own over a spread of realistic
+// parameters.  The timing kernels are checked against a long double
+// evaluation of the same trapezoid and the worst error is given in
+// stepper ticks, so optimization work has a fixed baseline:
+//
+//	make bench && ./bench
+//
+
+#define NSEG 4096		// parameter sets
+#define NAT 256			// time lookups per set
+#define VRES 0.000098425	// velo's default step
+#define VFSTEP 19500.0
+#define RFSTEP 20000.0		// rawstep's
+
+int debug = 0;
+
+extern double time2alpha(double alpha);
+
+typedef struct seg {
+    double l, vs, ve, vmax, amax, jmax;
+    double res;
+    double period;		// rawstep: seconds per stroke and back
+} SEG;
+
+SEG vseg[NSEG];			// velo segments, inches
+SEG rseg[NSEG];			// rawstep strokes, steps
+double alpha[NAT];
+double pts[NSEG][3][NAXIS];	// corners
+int dly[NSEG];
+
+long nops = 1000000;
+volatile double sink;		// keeps the results alive
+
+double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec + t.tv_nsec * 1e-9);
+}
+
+double urand(double lo, double hi)
+{
+    return (lo + (hi - lo) * (rand() / (RAND_MAX + 1.0)));
+}
+
+// log uniform, for lengths and limits spanning decades
+
+double lrand(double lo, double hi)
+{
+    return (exp(urand(log(lo), log(hi))));
+}
+
+// the time to x into the trapezoid for s, in long double
+
+long double reftime(SEG *s, long double x)
+{
+    long double a = s->amax;
+    long double vs = s->vs;
+    long double ve = s->ve;
+    long double vm, s1, s2;
+
+    vm = sqrtl((vs * vs + ve * ve + 2.0L * a * s->l) / 2.0L);
+    if (vm > s->vmax) {
+	vm = s->vmax;
+    }
+    s1 = (vm * vm - vs * vs) / (2.0L * a);
+    s2 = s->l - s1 - (vm * vm - ve * ve) / (2.0L * a);
+    if (x < s1) {
+	return ((sqrtl(vs * vs + 2.0L * a * x) - vs) / a);
+    } else if (x < s1 + s2) {
+	return ((vm - vs) / a + (x - s1) / vm);
+    }
+    return ((vm - vs) / a + s2 / vm +
+	(vm - sqrtl(fabsl(vm * vm - 2.0L * a * (x - s1 - s2)))) / a);
+}
+
+// velo segments: short to long moves, corner speeds each end that the
+// segment can get between, and optionally a jerk limit
+
+void vsegs()
+{
+    SEG *s;
+    double reach;
+    int i;
+
+    for (i = 0; i < NSEG; i++) {
+	s = &vseg[i];
+	s->l = lrand(1e-4, 2.0);
+	s->vmax = urand(0.01, 1.0);
+	s->amax = lrand(10.0, 2000.0);
+	s->jmax = lrand(100.0, 100000.0);
+	s->res = VRES;
+	s->ve = urand(0.0, s->vmax);
+	s->vs = urand(0.0, s->vmax);
+	reach = sqrt(s->ve * s->ve + 2.0 * s->amax * s->l);
+	s->vs = (s->vs < reach) ? s->vs : reach;
+	reach = sqrt(s->vs * s->vs + 2.0 * s->amax * s->l);
+	s->ve = (s->ve < reach) ? s->ve : reach;
+    }
+}
+
+// rawstep strokes: from rest to rest in 1 to 16 microsteps
+
+void rsegs()
+{
+    SEG *s;
+    int i;
+
+    for (i = 0; i < NSEG; i++) {
+	s = &rseg[i];
+	s->l = urand(10.0, 1200.0);
+	s->vmax = urand(5.0, 20.0);
+	s->amax = urand(0.5, 2.0);
+	s->jmax = 0.0;
+	s->vs = s->ve = 0.0;
+	s->res = 1.0 / (1 << (rand() % 5));
+	s->period = urand(0.5, 30.0);
+    }
+}
+
+void report(char *name, double t, long n, double err, char *unit)
+{
+    printf("%-28s %8.1f", name, t * 1e9 / n);
+    if (err >= 0.0) {
+	printf("   %10.3g %s", err, unit);
+    }
+    printf("\n");
+}
+
+void bench_setseg(int jerk)
+{
+    SEG *s;
+    double t0 = now();
+    long i;
+
+    for (i = 0; i < nops; i++) {
+	s = &vseg[i % NSEG];
+	setseg(s->l, s->vs, s->ve, s->vmax, s->amax, jerk ? s->jmax : 0.0,
+	    s->res, VFSTEP);
+	sink = segprofile()->t[0];
+    }
+    report(jerk ? "setseg -J" : "setseg", now() - t0, nops, -1.0, "");
+}
+
+// profile_solve on all NSEG velo segments at once, as velo -e does,
+// against one at a time, per segment
+
+double bl[NSEG], bvs[NSEG], bve[NSEG], bvmax[NSEG], bamax[NSEG];
+double bvm[NSEG], bs1[NSEG], bs2[NSEG], bs3[NSEG], bts1[NSEG], bts2[NSEG], bt[NSEG];
+
+void bench_solve(int batch)
+{
+    PROFILE p = {
+	NSEG, bl, bvs, bve, bvmax, bamax, bvm, bs1, bs2, bs3, bts1, bts2, bt, NULL
+    };
+    PROFILE q = p;
+    double t0;
+    long i, n = 0;
+    int k;
+
+    for (k = 0; k < NSEG; k++) {
+	bl[k] = vseg[k].l;
+	bvs[k] = vseg[k].vs;
+	bve[k] = vseg[k].ve;
+	bvmax[k] = vseg[k].vmax;
+	bamax[k] = vseg[k].amax;
+    }
+    q.n = 1;
+    t0 = now();
+    for (i = 0; n < nops; i++) {
+	if (batch) {
+	    profile_solve(&p, VRES);
+	} else {
+	    for (k = 0; k < NSEG; k++) {
+		q.l = bl + k; q.vs = bvs + k; q.ve = bve + k;
+		q.vmax = bvmax + k; q.amax = bamax + k;
+		q.vm = bvm + k; q.s1 = bs1 + k; q.s2 = bs2 + k; q.s3 = bs3 + k;
+		q.ts1 = bts1 + k; q.ts2 = bts2 + k; q.t = bt + k;
+		profile_solve(&q, VRES);
+	    }
+	}
+	sink = bt[i % NSEG];
+	n += NSEG;
+    }
+    report(batch ? "profile_solve n=4096" : "profile_solve n=1", now() - t0, n, -1.0, "");
+}
+
+// time2alpha over NAT fractions of each segment, timed apart from the
+// setup, and its worst error in ticks (trapezoids only)
+
+void bench_time2alpha(int jerk)
+{
+    SEG *s;
+    double t = 0.0, t0, err = 0.0, e, tt;
+    long i, n = 0;
+    int k;
+
+    for (i = 0; n < nops; i++) {
+	s = &vseg[i % NSEG];
+	setseg(s->l, s->vs, s->ve, s->vmax, s->amax, jerk ? s->jmax : 0.0,
+	    s->res, VFSTEP);
+	t0 = now();
+	for (k = 0, tt = 0.0; k < NAT; k++) {
+	    tt += time2alpha(alpha[k]);
+	}
+	t += now() - t0;
+	sink = tt;
+	n += NAT;
+    }
+    for (i = 0; !jerk && i < NSEG; i++) {
+	s = &vseg[i];
+	setseg(s->l, s->vs, s->ve, s->vmax, s->amax, 0.0, s->res, VFSTEP);
+	for (k = 0; k < NAT; k++) {
+	    e = fabsl(time2alpha(alpha[k]) - reftime(s, alpha[k] * s->l));
+	    err = (e > err) ? e : err;
+	}
+    }
+    report(jerk ? "time2alpha -J (double)" : "time2alpha (double)", t, n,
+	jerk ? -1.0 : err * VFSTEP, "ticks");
+}
+
+void bench_stepper()
+{
+    STEPPARM sp;
+    SEG *s;
+    double t0 = now();
+    long i;
+
+    for (i = 0; i < nops; i++) {
+	s = &rseg[i % NSEG];
+	stepper_set_parms(&sp, s->l, s->vs, s->ve, s->amax, s->vmax, 0.0, s->res);
+	sink = sp.t;
+    }
+    report("stepper_set_parms", now() - t0, nops, -1.0, "");
+}
+
+// time_at_l (float) against profile_time (double) on the same
+// strokes, errors in rawstep ticks: period*fstep per cycle
+
+void bench_time_at_l()
+{
+    STEPPARM sp;
+    PROFILE p;
+    SEG *s;
+    double tf = 0.0, td = 0.0, t0, ef = 0.0, ed = 0.0, e, x, scale;
+    float ff;
+    double dd;
+    long double cycle;
+    long i, n = 0;
+    int k, pen;
+
+    for (i = 0; n < nops; i++) {
+	s = &rseg[i % NSEG];
+	stepper_set_parms(&sp, s->l, s->vs, s->ve, s->amax, s->vmax, 0.0, s->res);
+	stepper_profile(&sp, &p);
+
+	t0 = now();
+	for (k = 0, ff = 0.0; k < NAT; k++) {
+	    ff += time_at_l(&sp, alpha[k] * s->l);
+	}
+	tf += now() - t0;
+	t0 = now();
+	for (k = 0, dd = 0.0; k < NAT; k++) {
+	    dd += profile_time(&p, 0, alpha[k] * s->l, &pen);
+	}
+	td += now() - t0;
+	sink = ff + dd;
+	n += NAT;
+    }
+    for (i = 0; i < NSEG; i++) {
+	s = &rseg[i];
+	stepper_set_parms(&sp, s->l, s->vs, s->ve, s->amax, s->vmax, 0.0, s->res);
+	stepper_profile(&sp, &p);
+	cycle = 2.0L * reftime(s, s->l);
+	scale = s->period * RFSTEP / cycle;
+	for (k = 0; k < NAT; k++) {
+	    x = (float) (alpha[k] * s->l);
+	    e = fabsl(time_at_l(&sp, x) - reftime(s, x)) * scale;
+	    ef = (e > ef) ? e : ef;
+	    e = fabsl(profile_time(&p, 0, x, &pen) - reftime(s, x)) * scale;
+	    ed = (e > ed) ? e : ed;
+	}
+    }
+    report("time_at_l (float)", tf, n, ef, "ticks");
+    report("profile_time (double)", td, n, ed, "ticks");
+}
+
+// cornercos, error against a long double dot product
+
+void bench_cornercos()
+{
+    double t0, t, err = 0.0, e;
+    long double dot, l1, l2, d1, d2;
+    long i;
+    int j, k;
+
+    t0 = now();
+    for (i = 0; i < nops; i++) {
+	j = i % NSEG;
+	sink = cornercos(pts[j][0], pts[j][1], pts[j][2]);
+    }
+    t = now() - t0;
+
+    for (j = 0; j < NSEG; j++) {
+	dot = l1 = l2 = 0.0L;
+	for (k = 0; k < NAXIS; k++) {
+	    d1 = (long double) pts[j][1][k] - pts[j][0][k];
+	    d2 = (long double) pts[j][2][k] - pts[j][1][k];
+	    dot += d1 * d2;
+	    l1 += d1 * d1;
+	    l2 += d2 * d2;
+	}
+	e = fabsl(cornercos(pts[j][0], pts[j][1], pts[j][2]) - dot / sqrtl(l1 * l2));
+	err = (e > err) ? e : err;
+    }
+    report("cornercos", t, nops, err, "cosine");
+}
+
+// the delay encoder into /dev/null, and the ticks it lost or gained
+
+void bench_delay()
+{
+    FILE *f;
+    double t0;
+    long i, want = 0, t1 = bc_ticks();
+
+    if ((f = fopen("/dev/null", "w")) == NULL) {
+	fprintf(stderr, "can't open /dev/null\n");
+	exit(1);
+    }
+    bc_output(f);
+    t0 = now();
+    for (i = 0; i < nops; i++) {
+	delay(dly[i % NSEG]);
+	want += dly[i % NSEG];
+    }
+    report("delay", now() - t0, nops, labs(bc_ticks() - t1 - want), "ticks");
+    fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    extern int optind;
+    extern char *optarg;
+    int errflg = 0;
+    int seed = 1;
+    int c, i, j, k;
+
+    while ((c = getopt(argc, argv, "n:s:")) != EOF) {
+	switch (c) {
+	case 'n':			// operations per kernel
+	    nops = atol(optarg);
+	    break;
+	case 's':			// random seed
+	    seed = atoi(optarg);
+	    break;
+	default:
+	    errflg = 1;
+	    break;
+	}
+    }
+    if (errflg || optind != argc || nops <= 0) {
+	fprintf(stderr, "usage: %s [options]\n", argv[0]);
+	fprintf(stderr, "     -n <ops>   ; operations per kernel (default 1000000)\n");
+	fprintf(stderr, "     -s <seed>  ; random seed (default 1)\n");
+	exit(1);
+    }
+
+    srand(seed);
+    vsegs();
+    rsegs();
+    for (k = 0; k < NAT; k++) {
+	alpha[k] = urand(0.0, 1.0);
+    }
+    for (i = 0; i < NSEG; i++) {
+	for (j = 0; j < 3; j++) {
+	    for (k = 0; k < NAXIS; k++) {
+		pts[i][j][k] = urand(-10.0, 10.0);
+	    }
+	}
+	dly[i] = 1 + (int) lrand(1.0, 500.0);
+    }
+
+    printf("%-28s %8s   %10s\n", "kernel", "ns/op", "max error");
+    bench_setseg(0);
+    bench_setseg(1);
+    bench_solve(0);
+    bench_solve(1);
+    bench_time2alpha(0);
+    bench_time2alpha(1);
+    bench_stepper();
+    bench_time_at_l();
+    bench_cornercos();
+    bench_delay();
+    exit(0);
+}
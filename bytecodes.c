@@ -4,6 +4,7 @@
 #include <math.h>
 #include "stepper.h"
 #include "bytecodes.h"
+#include "trace.h"
 
 void mode(int modeset);
 void step(int ch);
@@ -13,9 +14,9 @@ void center(int steps);
 int interp2mode(float interp);
 
 // implements simple s-code interpreter
-// DELAY   (7:0) '0'nnn nnnn  ; delay n+1 counts
+// DELAY   (7:0) '0'nnn nnnn  ; idle n ticks
 // DIR     (7:0) '1000' wxyz  ; direction (0=ccw, 1=cw)
-// STEP    (7:0) '1001' wxyz  ; step (1=step, 0=idle)
+// STEP    (7:0) '1001' wxyz  ; step (1=step, 0=idle), 1 tick
 // MODE    (7:0) '1010' 0mmm  ; set ustep mode
 // 	MS3 MS2 MS1
 // 	L   L   L    // full step
@@ -24,14 +25,131 @@ int interp2mode(float interp);
 // 	L   H   H    // eighth step
 // 	H   H   H    // sixteenth
 // STAT    (7:0) '1010' 1res  ; set reset, enable, sleep
+// LOOP    (7:0) '1011' 0000  ; start recording a loop body
+// ENDL    (7:0) '1011' 0001  ; end of body, then '0nnn nnnn' '0nnn nnnn'
+//                            ; give a 14 bit run count, 0=forever
 // ----    (7:0) '1011' ----  ; undefined
 // SPIN    (7:0) '11'nn nnnn  ; duty cycle is n/64 0=off
 
 int bdebug=0;
 
+// bytecodes normally go straight to stdout (or the bc_output() file),
+// but can be recorded into a buffer with bc_record() and collected
+// with bc_stop()
+
+static unsigned char *bcbuf=NULL;
+static int bclen=0;
+static int bcsize=0;
+static int recording=0;
+static FILE *bcout=NULL;	// NULL = stdout
+static FILE *bctee=NULL;	// copy of the output, if not NULL
+static long bcsent=0;		// bytes sent so far
+static int bcdir=0;		// last direction mask sent
+static long bctick=0;		// firmware ticks of the codes sent
+static int bcskip=0;		// loop count bytes still to come
+static FILE *bctrace=NULL;	// step records, if not NULL
+
+// send bytecodes to f instead of stdout
+
+void bc_output(FILE *f) {
+    bcout = f;
+}
+
+// also send a copy of the bytecodes to f
+
+void bc_tee(FILE *f) {
+    bctee = f;
+}
+
+// write a trace record (trace.h) of the firmware tick of every step
+
+void bc_trace(FILE *f) {
+    bctrace = f;
+}
+
+// a delay of n holds the output n ticks, a step takes one tick
+
+static void bc_count(int c) {
+    unsigned int t;
+
+    if (bcskip > 0) {
+	bcskip--;
+    } else if ((c & 0x80) == 0) {
+	bctick += c;
+    } else if ((c & 0xf0) == 0x90) {
+	if (bctrace) {
+	    t = bctick;
+	    putc(TRACE_STEP, bctrace);
+	    putc(c & 0x0f, bctrace);
+	    fwrite(&t, sizeof(t), 1, bctrace);
+	}
+	bctick++;
+    } else if ((c & 0xf0) == 0x80) {
+	bcdir = c & 0x0f;
+    } else if (c == 0xb1) {
+	bcskip = 2;		// ENDL run count
+    }
+}
+
+void bc_putc(int c) {
+    if (!recording) {
+	putc(c, bcout ? bcout : stdout);
+	if (bctee) {
+	    putc(c, bctee);
+	}
+	bcsent++;
+	bc_count(c);
+	return;
+    }
+    if (bclen >= bcsize) {
+	bcsize = bcsize ? 2*bcsize : 4096;
+	if ((bcbuf=(unsigned char *)realloc(bcbuf, bcsize)) == NULL) {
+	    fprintf(stderr, "bytecode buffer malloc error\n");
+	    exit(1);
+	}
+    }
+    bcbuf[bclen++] = c;
+}
+
+// number of bytecodes sent, and the direction mask in effect
+
+long bc_tell() {
+    return bcsent;
+}
+
+int bc_dir() {
+    return bcdir;
+}
+
+// firmware ticks taken by the bytecodes sent
+
+long bc_ticks() {
+    return bctick;
+}
+
+// start recording bytecodes into a fresh buffer
+
+void bc_record() {
+    free(bcbuf);		// one bc_stop() didn't hand over
+    bcbuf = NULL;
+    bclen = bcsize = 0;
+    recording = 1;
+}
+
+// stop recording, return the buffer (caller frees) and its length
+
+unsigned char *bc_stop(int *len) {
+    unsigned char *b = bcbuf;
+
+    recording = 0;
+    *len = bclen;
+    bcbuf = NULL;
+    return b;
+}
+
 void step(int ch) {
     if (!bdebug) {
-	putchar(0x90 | (ch&0x0f));
+	bc_putc(0x90 | (ch&0x0f));
     } else {
 	printf("step %d\n", ch);
     }
@@ -40,31 +158,64 @@ void step(int ch) {
 void dir(int cw) {
     if (!bdebug) {
 	if (cw) {
-	    putchar(0x80);	// cw
+	    bc_putc(0x80);	// cw
 	} else {
-	    putchar(0x8f);	// ccw
+	    bc_putc(0x8f);	// ccw
 	}
     } else {
 	printf("dir %d\n", cw);
     }
 }
 
+// set the direction of each axis, bit set = cw
+
+void dirs(int mask) {
+    if (!bdebug) {
+	bc_putc(0x80 | (mask&0x0f));
+    } else {
+	printf("dirs 0x%.2x\n", mask);
+    }
+}
+
 void mode(int modeset) {
-    putchar(0xa0 | (modeset&0x07));
+    bc_putc(0xa0 | (modeset&0x07));
+}
+
+// start a firmware loop body, at most LOOPMAX bytes long
+
+void loop_begin() {
+    if (!bdebug) {
+	bc_putc(0xb0);
+    } else {
+	printf("loop\n");
+    }
+}
+
+// end the loop body and run it count times in all (0=forever)
+
+void loop_end(int count) {
+    if (!bdebug) {
+	bc_putc(0xb1);
+	bc_putc((count>>7)&0x7f);
+	bc_putc(count&0x7f);
+    } else {
+	printf("endloop %d\n", count);
+    }
 }
 
-// delay cnt interrupt steps
+// delay cnt interrupt steps, the firmware idles n ticks for a
+// delay byte n so each full byte is worth 127
 void delay(int cnt) {
     if (!bdebug) {
 	// fprintf(stderr, "delay called with %d\n", cnt);
-	while (cnt > 128) {
-	    // fprintf(stderr, "delay 128\n");
-	    putchar(0x7f);
-	    cnt-=128;
+	while (cnt > 127) {
+	    // fprintf(stderr, "delay 127\n");
+	    bc_putc(0x7f);
+	    cnt-=127;
 	}
 	if (cnt > 0) {
 	    // fprintf(stderr, "delay %d\n", cnt);
-	    putchar(cnt&0x7f);
+	    bc_putc(cnt&0x7f);
 	}
     } else {
 	printf("delay %d\n", cnt);
@@ -1,6 +1,21 @@
+#define LOOPMAX  512		// firmware loop body size (servo4.c)
+#define LOOPCNT  16383		// largest loop run count
+
+extern void bc_output(FILE *f);
+extern void bc_tee(FILE *f);
+extern void bc_trace(FILE *f);
+extern void bc_putc(int c);
+extern long bc_tell(void);
+extern int bc_dir(void);
+extern long bc_ticks(void);
+extern void bc_record(void);
+extern unsigned char *bc_stop(int *len);
 extern void mode(int modeset);
 extern void step(int ch);
 extern void dir(int cw);
+extern void dirs(int mask);
 extern void delay(int cnt);
 extern void center(int steps);
 extern int interp2mode(float interp);
+extern void loop_begin(void);
+extern void loop_end(int count);
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+//
+// plan cache for velo.  An entry is the byte code output of one run,
+// <key>.bc, and its resume index <key>.idx if one was asked for.  The
+// key is a 64 bit FNV-1a hash of the tool version, every planner
+// parameter and the input, so a hit can be streamed out as is.
+// Entries are written to a temporary name and renamed into place, so
+// a run that dies half way never leaves a short plan behind, only a
+// <key>.<pid> or <key>.idx.<pid> file that is removed once it is
+// TMPAGE old.  Least recently used entries are removed to keep the
+// directory, temporary files included, under CACHEMAX bytes.
+//
+
+#define FNVOFFSET 0xcbf29ce484222325ULL
+#define FNVPRIME  0x100000001b3ULL
+#define TMPAGE 3600		// seconds before a temporary file is stale
+
+extern int debug;
+
+static char tmpname[1024];
+
+// fold n bytes at p into hash *h, start with *h = 0
+
+void cache_hash(unsigned long long *h, void *p, long n)
+{
+    unsigned char *c = (unsigned char *) p;
+
+    if (*h == 0) {
+	*h = FNVOFFSET;
+    }
+    while (n-- > 0) {
+	*h ^= *c++;
+	*h *= FNVPRIME;
+    }
+}
+
+// fold the contents of a file into the hash, -1 if it can't be read
+
+int cache_hashfile(unsigned long long *h, char *name)
+{
+    FILE *f;
+    char b[4096];
+    long n;
+
+    if ((f = fopen(name, "r")) == NULL) {
+	return (-1);
+    }
+    while ((n = fread(b, 1, sizeof(b), f)) > 0) {
+	cache_hash(h, b, n);
+    }
+    fclose(f);
+    return (0);
+}
+
+static void entry(char *name, int size, char *dir,
+		  unsigned long long key, char *ext)
+{
+    snprintf(name, size, "%s/%016llx.%s", dir, key, ext);
+}
+
+static int copy(char *from, FILE *to)
+{
+    FILE *f;
+    char b[65536];
+    long n;
+
+    if ((f = fopen(from, "r")) == NULL) {
+	return (-1);
+    }
+    while ((n = fread(b, 1, sizeof(b), f)) > 0) {
+	fwrite(b, 1, n, to);
+    }
+    fclose(f);
+    return (0);
+}
+
+// on a hit stream the plan to stdout, copy its index to xname (if
+// not NULL) and return 1, else return 0
+
+int cache_get(char *dir, unsigned long long key, char *xname)
+{
+    char name[1024];
+    char iname[1024];
+    FILE *fx;
+
+    entry(name, sizeof(name), dir, key, "bc");
+    entry(iname, sizeof(iname), dir, key, "idx");
+    if (access(name, R_OK) != 0 || 
+	(xname != NULL && access(iname, R_OK) != 0)) {
+	return (0);
+    }
+    if (xname != NULL) {
+	if ((fx = fopen(xname, "w")) == NULL) {
+	    return (0);
+	}
+	copy(iname, fx);
+	fclose(fx);
+	utime(iname, NULL);
+    }
+    if (copy(name, stdout) < 0) {
+	return (0);
+    }
+    utime(name, NULL);		// mark it recently used
+    if (debug & 32) {
+	fprintf(stderr, "cache hit %s\n", name);
+    }
+    return (1);
+}
+
+// open a new entry for writing, NULL if the cache isn't writable
+
+FILE *cache_put(char *dir, unsigned long long key)
+{
+    mkdir(dir, 0777);
+    snprintf(tmpname, sizeof(tmpname), "%s/%016llx.%d", dir, key, getpid());
+    return (fopen(tmpname, "w"));
+}
+
+static int suffix(char *s, char *ext)
+{
+    int n = strlen(s);
+    int k = strlen(ext);
+
+    return (n > k && strcmp(s + n - k, ext) == 0);
+}
+
+// a temporary file of cache_put() or cache_done(), ends in .<pid>
+
+static int temporary(char *s)
+{
+    char *p = strrchr(s, '.');
+
+    return (p != NULL && p != s && p[1] != '\0' &&
+	strspn(p + 1, "0123456789") == strlen(p + 1));
+}
+
+// remove the least recently used entries until the cache fits, and
+// temporary files left by runs that died
+
+static void evict(char *dir, long max)
+{
+    DIR *dp;
+    struct dirent *de;
+    struct stat st;
+    char name[1024];
+    char old[1024];
+    long total;
+    time_t tmin;
+    time_t now = time(NULL);
+
+    for (;;) {
+	if ((dp = opendir(dir)) == NULL) {
+	    return;
+	}
+	total = 0;
+	tmin = 0;
+	old[0] = '\0';
+	while ((de = readdir(dp)) != NULL) {
+	    if (!suffix(de->d_name, ".bc") && !suffix(de->d_name, ".idx") &&
+		!temporary(de->d_name)) {
+		continue;
+	    }
+	    snprintf(name, sizeof(name), "%s/%s", dir, de->d_name);
+	    if (stat(name, &st) != 0) {
+		continue;
+	    }
+	    if (temporary(de->d_name)) {
+		if (now - st.st_mtime > TMPAGE) {
+		    if (debug & 32) {
+			fprintf(stderr, "cache stale %s\n", name);
+		    }
+		    unlink(name);
+		} else {
+		    total += st.st_size;	// still being written
+		}
+		continue;
+	    }
+	    total += st.st_size;
+	    if (old[0] == '\0' || st.st_mtime < tmin) {
+		tmin = st.st_mtime;
+		strcpy(old, name);
+	    }
+	}
+	closedir(dp);
+	if (total <= max || old[0] == '\0') {
+	    return;
+	}
+	if (debug & 32) {
+	    fprintf(stderr, "cache evict %s\n", old);
+	}
+	unlink(old);
+    }
+}
+
+// finish a new entry: move the plan into place, keep a copy of the
+// index written to xname (if not NULL) and trim the cache
+
+void cache_done(char *dir, unsigned long long key, FILE *f, char *xname)
+{
+    char name[1024];
+    char iname[1024];
+    char itmp[1100];
+    FILE *fx;
+
+    if (fclose(f) != 0) {
+	unlink(tmpname);
+	return;
+    }
+    if (xname != NULL) {
+	entry(iname, sizeof(iname), dir, key, "idx");
+	snprintf(itmp, sizeof(itmp), "%s.%d", iname, getpid());
+	if ((fx = fopen(itmp, "w")) != NULL) {
+	    copy(xname, fx);
+	    if (fclose(fx) == 0) {
+		rename(itmp, iname);
+	    } else {
+		unlink(itmp);
+	    }
+	}
+    }
+    entry(name, sizeof(name), dir, key, "bc");
+    rename(tmpname, name);
+    evict(dir, CACHEMAX);
+}
@@ -0,0 +1,7 @@
+#define CACHEMAX (256L*1024*1024)	// cache size bound (bytes)
+
+extern void cache_hash(unsigned long long *h, void *p, long n);
+extern int cache_hashfile(unsigned long long *h, char *name);
+extern int cache_get(char *dir, unsigned long long key, char *xname);
+extern FILE *cache_put(char *dir, unsigned long long key);
+extern void cache_done(char *dir, unsigned long long key, FILE *f, char *xname);
@@ -0,0 +1,233 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "corner.h"
+#include "interpolate.h"
+
+extern int debug;
+
+//
+// corner blending: each sharp junction P1 between the segments
+// P0->P1 and P1->P2 is replaced by a circular arc that is tangent to
+// both segments and stays within btol of the original corner.  The
+// arc is handed to the planner as a short run of chords, each tagged
+// with the arc radius so the planner can limit speed to sqrt(amax*R)
+// instead of forcing a near stop at the corner.
+//
+// Points are pushed in with blend_put() and pulled back out with
+// blend_get(); the stage holds one point of input lookahead.
+//
+
+#define MAXCHORD (M_PI/12.0)	// max turning angle per arc chord
+#define MAXARC	 16		// max chords per arc (180/15 + slack)
+#define MAXOUT	 (MAXARC+4)	// output queue size
+#define MINANGLE 1.0e-6		// smaller bends are left alone
+#define MINLEN	 1.0e-12	// degenerate segment length
+
+double btol = 0.0;
+double jdev = 0.0;
+
+static double raw[3][NAXIS];	// P0, P1, P2 input window
+static int nraw = 0;
+
+static double outp[MAXOUT][NAXIS];	// queued output points
+static double outr[MAXOUT];	// and their arc radii
+static int nout = 0;
+static int iout = 0;
+
+static double vlen(double *a)
+{
+    int k;
+    double sum = 0.0;
+    for (k = 0; k < NAXIS; k++) {
+	sum += a[k] * a[k];
+    }
+    return (sqrt(sum));
+}
+
+// efficient calculation of cosine of the bend angle at p1 in 4d
+
+double cornercos(double *p0, double *p1, double *p2)
+{
+    int k;
+    double dot = 0.0;
+    double l1 = 0.0;
+    double l2 = 0.0;
+    double d1, d2;
+
+    for (k = 0; k < NAXIS; k++) {
+	d1 = p1[k] - p0[k];
+	d2 = p2[k] - p1[k];
+	dot += d2 * d1;
+	l1 += d1 * d1;
+	l2 += d2 * d2;
+    }
+    return (dot / sqrt(l1) / sqrt(l2));
+}
+
+// junction deviation corner speed: the fastest speed at which a
+// virtual arc tangent to both segments, passing within dev of the
+// corner, can be followed at amax.  Unlike the step size model this
+// is independent of the stepper resolution.
+
+double junction(double cosine, double amax, double dev, double vmax)
+{
+    double sinhalf;
+
+    if (cosine > 1.0) cosine = 1.0;
+    if (cosine < -1.0) cosine = -1.0;
+
+    // sin of half the angle between the segments (not the bend)
+
+    sinhalf = sqrt((1.0 + cosine) / 2.0);
+    if (sinhalf > 1.0 - MINANGLE) {
+	return (vmax);
+    }
+    return (min(vmax, sqrt(amax * dev * sinhalf / (1.0 - sinhalf))));
+}
+
+static void emit(double *p, double r)
+{
+    int k;
+
+    if (nout >= MAXOUT) {
+	fprintf(stderr, "blend: output queue overflow\n");
+	exit(3);
+    }
+    for (k = 0; k < NAXIS; k++) {
+	outp[nout][k] = p[k];
+    }
+    outr[nout] = r;
+    nout++;
+}
+
+// replace corner p1 with an arc, or pass it through unchanged
+
+static void blend(double *p0, double *p1, double *p2)
+{
+    double u1[NAXIS], u2[NAXIS], m[NAXIS];
+    double a[NAXIS], b[NAXIS], cc[NAXIS], ra[NAXIS], rb[NAXIS];
+    double p[NAXIS];
+    double l1, l2, lm;
+    double cosine, phi, sec, sag, rad, t, s, sa, sb;
+    int nchord, i, k;
+
+    for (k = 0; k < NAXIS; k++) {
+	u1[k] = p1[k] - p0[k];
+	u2[k] = p2[k] - p1[k];
+    }
+    l1 = vlen(u1);
+    l2 = vlen(u2);
+    if (l1 < MINLEN || l2 < MINLEN) {
+	emit(p1, 0.0);
+	return;
+    }
+    for (k = 0; k < NAXIS; k++) {
+	u1[k] /= l1;
+	u2[k] /= l2;
+	m[k] = u2[k] - u1[k];
+    }
+    cosine = cornercos(p0, p1, p2);
+    if (cosine > 1.0) cosine = 1.0;
+    if (cosine < -1.0) cosine = -1.0;
+    phi = acos(cosine);
+
+    // straight through, or a full reversal which can't be blended
+
+    if (phi < MINANGLE || phi > M_PI - MINANGLE) {
+	emit(p1, 0.0);
+	return;
+    }
+
+    // size the arc so that the arc midpoint plus the sagitta of its
+    // chords stays within btol of the corner, but never use more than
+    // half of either segment so neighbouring blends can't overlap
+
+    nchord = (int) ceil(phi / MAXCHORD);
+    sec = 1.0 / cos(phi / 2.0);
+    sag = 1.0 - cos(phi / (2.0 * nchord));
+    rad = btol / (sec - 1.0 + sag);
+    t = rad * tan(phi / 2.0);
+    if (t > 0.5 * min(l1, l2)) {
+	t = 0.5 * min(l1, l2);
+	rad = t / tan(phi / 2.0);
+    }
+
+    lm = vlen(m);
+    for (k = 0; k < NAXIS; k++) {
+	a[k] = p1[k] - t * u1[k];
+	b[k] = p1[k] + t * u2[k];
+	cc[k] = p1[k] + rad * sec * m[k] / lm;
+	ra[k] = (a[k] - cc[k]) / rad;
+	rb[k] = (b[k] - cc[k]) / rad;
+    }
+
+    // slerp the radius vector from a to b around the arc center
+
+    for (i = 0; i <= nchord; i++) {
+	s = (double) i / (double) nchord;
+	sa = sin((1.0 - s) * phi) / sin(phi);
+	sb = sin(s * phi) / sin(phi);
+	for (k = 0; k < NAXIS; k++) {
+	    p[k] = cc[k] + rad * (sa * ra[k] + sb * rb[k]);
+	}
+	emit(p, rad);
+    }
+
+    if (debug & 2) {
+	fprintf(stderr, "blend: phi:%g t:%g r:%g chords:%d\n",
+		phi, t, rad, nchord);
+    }
+}
+
+// push the next input point into the blending stage
+
+void blend_put(double *p)
+{
+    int k;
+
+    for (k = 0; k < NAXIS; k++) {
+	raw[nraw][k] = p[k];
+    }
+    if (nraw == 0) {
+	emit(raw[0], 0.0);		// first point passes through
+	nraw = 1;
+    } else if (nraw == 1) {
+	nraw = 2;
+    } else {
+	blend(raw[0], raw[1], raw[2]);
+	for (k = 0; k < NAXIS; k++) {
+	    raw[0][k] = raw[1][k];
+	    raw[1][k] = raw[2][k];
+	}
+    }
+}
+
+// end of input, release the held last point
+
+void blend_flush(void)
+{
+    if (nraw == 2) {
+	emit(raw[1], 0.0);
+    }
+    nraw = 0;
+}
+
+// pull the next blended point, returns 0 if none are ready
+
+int blend_get(double *p, double *r)
+{
+    int k;
+
+    if (iout >= nout) {
+	iout = nout = 0;
+	return (0);
+    }
+    for (k = 0; k < NAXIS; k++) {
+	p[k] = outp[iout][k];
+    }
+    *r = outr[iout];
+    iout++;
+    return (1);
+}
@@ -0,0 +1,10 @@
+#define NAXIS 4			// x, y, z, w
+
+extern double btol;		// corner blending tolerance (0=off)
+extern double jdev;		// junction deviation (0=use step size model)
+
+extern double cornercos(double *p0, double *p1, double *p2);
+extern double junction(double cosine, double amax, double dev, double vmax);
+extern void blend_put(double *p);
+extern void blend_flush(void);
+extern int blend_get(double *p, double *r);
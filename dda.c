@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "profile.h"
+#include "interpolate.h"
+#include "bytecodes.h"
+#include "dda.h"
+
+//
+// integer step engine, an alternative to interpolate().
+//
+// The axes are stepped with a Bresenham DDA over n = max(|dx|,|dy|,
+// |dz|,|dw|) major steps, so every axis lands exactly on its target
+// count.  Major step k is at path distance s = k*l/n, and with
+// sigma = n/l steps/inch and f ticks/second the profile times become
+// (in ticks):
+//
+//	ramp up:	T(k) = sqrt(B1^2 + C*k) - B1
+//	cruise:		T(k) = T1 + (k - K1)*f/(vm*sigma)
+//	ramp down:	T(k) = T2 + Bm - sqrt(Bm^2 + C*K2 - C*k)
+//
+// with B1 = f*vs/a, Bm = f*vm/a, C = 2*f^2/(a*sigma), K1 = s1*sigma,
+// K2 = (s1+s2)*sigma.  The constants are set up once per segment in
+// 1/256 tick fixed point, after which each step costs one integer
+// square root and no floating point.  The fractional tick left at the
+// end of a segment carries into the next one.
+//
+
+#define XMASK 1
+#define YMASK 2
+#define ZMASK 4
+#define WMASK 8
+
+extern int debug;
+
+static long long tclock = 0;	// start of this segment (1/256 ticks)
+static long long last = 0;	// tick of the last step
+
+// floor of the square root of x, one result bit per pass
+
+unsigned long long isqrt64(unsigned long long x)
+{
+    unsigned long long r = 0;
+    unsigned long long b = 1ULL << 62;
+
+    while (b > x) {
+	b >>= 2;
+    }
+    while (b != 0) {
+	if (x >= r + b) {
+	    x -= r + b;
+	    r = (r >> 1) + b;
+	} else {
+	    r >>= 1;
+	}
+	b >>= 2;
+    }
+    return (r);
+}
+
+// set up the fixed point ramp for n major steps over profile p
+
+void dda_ramp(RAMP *r, PROFILE *p, long long n, double f)
+{
+    double a = p->amax[0];
+    double sigma = (double) n / p->l[0];
+    double b1 = f * p->vs[0] / a;
+    double bm = f * p->vm[0] / a;
+    double c = 2.0 * f * f / (a * sigma);
+    double k1 = p->s1[0] * sigma;
+    double k2 = (p->s1[0] + p->s2[0]) * sigma;
+
+    r->n = n;
+    r->k1 = (long long) ceil(k1);
+    r->k2 = (long long) ceil(k2);
+    r->x1 = llround(65536.0 * b1 * b1);
+    r->b1 = isqrt64(r->x1);
+    r->y = llround(65536.0 * c);
+    r->t1 = llround(256.0 * f * p->ts1[0]);
+    r->tc = llround(65536.0 * f / (p->vm[0] * sigma));
+    r->c1 = llround(k1 * r->tc);
+    r->t2 = llround(256.0 * (f * p->ts2[0] + bm));
+    r->xd = llround(65536.0 * (bm * bm + c * k2));
+    r->t = llround(256.0 * f * p->t[0]);
+
+    if (debug & 1) {
+	fprintf(stderr, "#dda: n:%lld k1:%lld k2:%lld b1:%lld y:%lld tc:%lld t:%lld\n",
+	    r->n, r->k1, r->k2, r->b1, r->y, r->tc, r->t);
+    }
+}
+
+// time of major step k from the start of the segment (1/256 ticks)
+
+long long dda_tick(RAMP *r, long long k)
+{
+    long long x;
+
+    if (k < r->k1) {
+	return (isqrt64(r->x1 + r->y * k) - r->b1);
+    } else if (k < r->k2) {
+	return (r->t1 + ((k * r->tc - r->c1) >> 8));
+    }
+    x = r->xd - r->y * k;
+    if (x < 0) {
+	x = 0;
+    }
+    return (r->t2 - isqrt64(x));
+}
+
+// step from xloc..wloc to x2..w2 (in steps) along the current segment
+// profile p, return the segment time
+
+double dda(PROFILE *p, int x2, int y2, int z2, int w2, double f)
+{
+    int dx[4], err[4];
+    int dirmask = 0;
+    int mask;
+    long long k, n, tk, dly;
+    RAMP r;
+    int i;
+
+    dx[0] = x2 - xloc;
+    dx[1] = y2 - yloc;
+    dx[2] = z2 - zloc;
+    dx[3] = w2 - wloc;
+
+    n = 0;
+    for (i = 0; i < 4; i++) {
+	if (dx[i] > 0) {
+	    dirmask |= (1 << i);
+	} else {
+	    dx[i] = -dx[i];
+	}
+	if (dx[i] > n) {
+	    n = dx[i];
+	}
+    }
+
+    if (debug & 4) {
+	fprintf(stderr, "DIR 0x%.2x\n", dirmask);
+    } else {
+	dirs(dirmask);
+    }
+
+    if (n == 0) {
+	tclock += llround(256.0 * f * p->t[0]);
+	return (p->t[0]);
+    }
+
+    dda_ramp(&r, p, n, f);
+
+    for (i = 0; i < 4; i++) {
+	err[i] = n / 2;
+    }
+
+    for (k = 1; k <= n; k++) {
+	mask = 0;
+	for (i = 0; i < 4; i++) {
+	    err[i] -= dx[i];
+	    if (err[i] < 0) {
+		err[i] += n;
+		mask |= (1 << i);
+	    }
+	}
+
+	if (mask & XMASK) { xloc += (dirmask & XMASK) ? 1 : -1; }
+	if (mask & YMASK) { yloc += (dirmask & YMASK) ? 1 : -1; }
+	if (mask & ZMASK) { zloc += (dirmask & ZMASK) ? 1 : -1; }
+	if (mask & WMASK) { wloc += (dirmask & WMASK) ? 1 : -1; }
+
+	// every step takes at least one tick.  The firmware idles dly
+	// ticks for the DELAY codes and one more for the STEP
+
+	tk = (tclock + dda_tick(&r, k)) >> 8;
+	dly = tk - last;
+	if (dly < 1) {
+	    dly = 1;
+	}
+	last += dly;
+
+	if (debug & 4) {
+	    fprintf(stderr, "DEL %lld\n", dly);
+	    fprintf(stderr, "STP 0x%.2x\n", mask);
+	} else {
+	    delay((int) dly);
+	    step(mask);
+	}
+    }
+
+    // keep only the fractional tick and the lead of the last step
+
+    tclock += r.t;
+    tk = tclock >> 8;
+    tclock -= tk << 8;
+    last -= tk;
+
+    return (p->t[0]);
+}
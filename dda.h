@@ -0,0 +1,22 @@
+// integer step engine: a Bresenham DDA over the axes and a fixed
+// point (1/256 tick) rate ramp for the trapezoid profile
+
+typedef struct ramp {
+    long long n;	// major steps in the segment
+    long long k1;	// first step past the ramp up
+    long long k2;	// first step of the ramp down
+    long long b1;	// ramp up offset (1/256 ticks)
+    long long x1;	// ramp up square root bias (1/65536 ticks^2)
+    long long y;	// square root slope per step (1/65536 ticks^2)
+    long long t1;	// time of end of ramp up (1/256 ticks)
+    long long tc;	// cruise ticks per step (1/65536 ticks)
+    long long c1;	// cruise offset (1/65536 ticks)
+    long long t2;	// time of end of cruise plus ramp down bias
+    long long xd;	// ramp down square root bias (1/65536 ticks^2)
+    long long t;	// segment time (1/256 ticks)
+} RAMP;
+
+extern unsigned long long isqrt64(unsigned long long x);
+extern void dda_ramp(RAMP *r, PROFILE *p, long long n, double f);
+extern long long dda_tick(RAMP *r, long long k);
+extern double dda(PROFILE *p, int x2, int y2, int z2, int w2, double f);
@@ -11,31 +11,124 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <limits.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "serial.h"
+#include "status.h"
+#include "profile.h"
+#include "interpolate.h"
+#include "bytecodes.h"
+#include "dda.h"
 
 #define XMASK 1
 #define YMASK 2
 #define ZMASK 4
 #define WMASK 8
 
-#define BAUD    B230400       /* baudrate */
-//#define BAUD  B115200       /* baudrate */
-//#define BAUD    B9600         /* baudrate */
-//#define BAUD    B57600        /* baudrate */
-//#define BAUD    B19200        /* baudrate */
+FILE *pfd;
+char *dev = SERIAL_DEV;
+int baud = SERIAL_BAUD;
+#define RES 0.000098425		// velo's default step size (inches)
+double res = RES;		// step size the job was planned for
+int debug = 0;
 
-#define _BSD_SOURCE 1
-#define TIMEOUT 1
+char *xname = NULL;		// resume index from velo -x
+int sline = 0;			// resume at this input line
+double amax = 1000.0;		// lead-in acceleration
+double vmax = 0.2;		// lead-in velocity
+int cur[4];			// machine position now (steps)
 
-#define MODEM "/dev/ttyUSB0"
+STATUS st;			// last status frame from the firmware
+#define WINDOW 8192		// default window with a status channel
 
-int fd;
-FILE *pfd;
-double res = .0001;
+unsigned long window = 0;	// most bytes ahead of the firmware, 0=any
+unsigned long sent = 0;		// bytes sent since the base
+unsigned long base = 0;		// firmware byte count when we started
+unsigned long dry = 0;		// ticks it ran dry during the job
+int running = 0;		// it has started stepping
+long home[4];			// firmware position when we started
+int eof = 0;			// all the input has been sent
 
 #define FIRQ 19531.0
 
+// ticks of motion in the byte codes so far, and whether a run count
+// byte is due
+
+typedef struct tickmark {
+    long ticks;
+    int skip;
+} TICKMARK;
+
+// with an override, feed also holds back on the motion time it has
+// sent ahead of the firmware, not just bytes, which bounds a hold
+
+#define TAHEAD 100.0		// default ms of motion ahead
+#define TRING 65536		// bytes whose tick counts are kept
+
+double tahead = TAHEAD;		// ms of motion ahead, 0=any
+long tmax = 0;			// the same in ticks, 0=none
+TICKMARK tput;			// ticks sent
+long tring[TRING];		// ticks sent before each byte
+unsigned long tfirst = 0;	// first byte counted, after a lead-in
+
+// feed override: the job runs at ovr times its planned rate, changed
+// from the keyboard (-k) or a control socket (-o) as it runs
+
+#define OMIN 0.1		// slowest override
+#define OMAX 2.0		// fastest, in steady motion only
+
+int override = 0;		// rescale the delays
+double ovr = 1.0;		// override now
+double otarget = 1.0;		// override asked for
+double ocarry = 0.0;		// fraction of a tick owed
+long opend = 0;			// idle ticks held until the next code
+int oskip = 0;			// ENDL run count bytes to pass through
+int keys = 0;			// take + - 0 from the terminal
+int ktty = -1;
+struct termios ktio;		// terminal settings to restore
+char *oname = NULL;		// control socket
+int osock = -1;
+int oconn = -1;			// control connection
+char obuf[64];			// partial control line
+int nobuf = 0;
+int oloop = 0;			// inside a LOOP body, sent as planned
+
+// planned accelerations scale as the square of the override, so over
+// 100% is only for steady motion.  The input is read LOOKAHEAD ticks
+// ahead and any step where an axis isn't steady marked, and the
+// override ramps down to 100% before it gets there.
+
+#define LOOKAHEAD 4883		// planned ticks read ahead, 250 ms
+#define LOOKBUF 65536		// most bytes read ahead
+#define NHIST 1024		// most steps an axis is judged steady over
+
+unsigned char look[LOOKBUF];	// bytes read ahead
+long lticks[LOOKBUF];		// planned ticks before each
+char lbad[LOOKBUF];		// not steady there
+unsigned long nlook = 0;	// bytes read
+unsigned long nused = 0;	// bytes taken
+unsigned long lflag = 0;	// next one not steady, nlook if none read
+int lbadnow = 0;		// the last one taken wasn't steady
+int leof = 0;
+TICKMARK lnow;			// planned ticks read
+int ldirs = 0;			// direction bits read
+long hist[4][NHIST+1];		// planned ticks of each axis' last steps
+long nhist[4];
+
+// feed hold: the override ramps down to a stop and nothing more is
+// sent until resumed, when it ramps back up to the one asked for
+
+int hold = 0;			// hold asked for
+long otick = 0;			// ticks sent, rescaled
+double thold;			// when the hold was asked for
+long khold;			// otick then
+unsigned long qhold;		// bytes on the way to the firmware then
+long tqhold;			// ticks of motion ahead of it then
+
 #define FSTART 10
 #define FSTOP  6000
 
@@ -48,108 +141,1049 @@ void myputchar(char c) {
     extern FILE *pfd;
     extern int errno;
     if (fputc(c, pfd) == EOF) {
-       printf("can't write to %s: %s\n", MODEM, strerror(errno));
+       printf("can't write to %s: %s\n", dev, strerror(errno));
     }
 }
 
-main() {
-   int i, k;
-   int c;
+// read back status frames, waiting up to ms for one.  Returns the
+// number of frames read.
 
-   double t;
-   double theta=0.0;
-   double val2 = 0.0;
-   double val = 0.0;
-   int delay=0;
-   double dtheta;
-   int xdir, ydir, zdir, wdir;
-   int xloc, yloc, zloc, wloc;
+int telemetry(int ms) {
+    unsigned char buf[256];
+    unsigned int idle = st.idle;
+    int k, i;
+    int nf = 0;
 
-   init_drip(MODEM);
+    while ((k = serial_read(buf, sizeof(buf), nf ? 0 : ms)) > 0) {
+	for (i = 0; i < k; i++) {
+	    if (!status_byte(&st, buf[i])) {
+		continue;
+	    }
+	    if (nf++ == 0 && st.frames == 1) {
+		base = st.rxcount - sent;
+		memcpy(home, st.pos, sizeof(home));
+	    } else if (running && !hold && (!eof || sent > status_taken(&st, base, sent))) {
+		dry += (st.idle - idle) & 0xffff;
+	    }
+	    idle = st.idle;
+	    running |= (st.ticks > 0 || memcmp(home, st.pos, sizeof(home)));
+	}
+    }
+    if (nf > 0) {
+	fprintf(stderr, "  [X: %#8.4f] [Y: %#8.4f] [Z: %#8.4f] [W: %#8.4f]"
+	    " rx %4u q %3d %6.1fms dry %lu\r",
+	    st.pos[0]*res, st.pos[1]*res, st.pos[2]*res, st.pos[3]*res,
+	    st.rxfill, st.entries, st.ticks*1000.0/FIRQ, dry);
+	if (override) {
+	    fprintf(stderr, " ovr %3.0f%%%s", ovr*100.0, hold ? " HOLD" : "");
+	}
+	fflush(stderr);
+    }
+    return (nf);
+}
 
-   xdir = ydir = zdir = wdir = 0;
-   xloc = yloc = zloc = wloc = 0;
+// ask for an override of pct percent
 
-   while((c=getchar()) != EOF) {
+void setovr(double pct) {
+    otarget = pct / 100.0;
+    if (otarget < OMIN) otarget = OMIN;
+    if (otarget > OMAX) otarget = OMAX;
+}
 
-       if ((c&0xf0) == 0x80) {		// dir
-	   xdir = ydir = zdir = wdir = -1;
-           if (c&XMASK) xdir=1;
-           if (c&YMASK) ydir=1;
-           if (c&ZMASK) zdir=1;
-           if (c&WMASK) wdir=1;
-       } else if ((c&0xf0) == 0x90) {	// step
-           if (c&XMASK) xloc+=xdir;
-           if (c&YMASK) yloc+=ydir;
-           if (c&ZMASK) zloc+=zdir;
-           if (c&WMASK) wloc+=wdir;
-	   fprintf(stderr,"  [X: %#8.4f] [Y: %#8.4f] [Z: %#8.4f] [W: %#8.4f]\r", 
-	       xloc*res, yloc*res, zloc*res, wloc*res);
-	   fflush(stderr);
-       }
+double now() {
+    struct timespec ts;
 
-      myputchar(c);
-   }
-   fprintf(stderr,"\n");
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec * 1e-9);
 }
 
+// count the ticks of byte c into m
 
-struct termios oldtio, newtio;
+void tickcount(TICKMARK *m, int c) {
+    if (m->skip > 0) {
+	m->skip--;
+    } else if (c < 0x80) {
+	m->ticks += c;
+    } else if ((c&0xf0) == 0x90) {
+	m->ticks++;
+    } else if (c == 0xb1) {		// ENDL, loops count once
+	m->skip = 2;
+    }
+}
 
-int set_timeout(int decisecs) {
-    extern struct termios oldtio, newtio;
-    extern int fd;
-    bzero(&newtio, sizeof(newtio));
-    newtio.c_cflag = BAUD|CS8|CREAD|CRTSCTS;
-    newtio.c_iflag = IGNPAR;
-    newtio.c_oflag = 0;
-    newtio.c_lflag = 0; /* non-canonical, no echo, ... */
+// ticks of motion sent that the firmware hasn't run: those in the
+// bytes it hasn't parsed yet, and those in its tick queue
 
-    newtio.c_cc[VTIME]=decisecs;  /* inter-char timer decisecs */
-    newtio.c_cc[VMIN]=0;          /* block till n chars read */
+long ahead() {
+    unsigned long taken = status_taken(&st, base, sent);
+    unsigned long off;
+    long t;
 
-    tcflush(fd, TCIFLUSH);
-    tcsetattr(fd, TCSANOW, &newtio);
+    if (taken < st.rxfill || taken - st.rxfill < tfirst) {
+	t = 0;				// still in the lead-in
+    } else if ((off = taken - st.rxfill) >= sent) {
+	t = tput.ticks;
+    } else if (sent - off > TRING) {
+	return (LONG_MAX);		// too far behind to tell
+    } else {
+	t = tring[off % TRING];
+    }
+    return (tput.ticks - t + st.ticks);
 }
 
-int init_drip(char *tty) {
+// ask for a hold, or to resume from one
 
-    extern FILE *pfd;
-    extern int fd;
-    extern struct termios oldtio, newtio;
+void sethold(int on) {
+    if (on && !hold) {
+	thold = now();
+	khold = otick;
+	qhold = (st.frames > 0) ? sent - status_taken(&st, base, sent) : 0;
+	tqhold = (st.frames > 0) ? ahead() : 0;
+    }
+    hold = on;
+}
+
+// a control line: "<pct>" sets the override, "+<n>" or "-<n>" moves it
+// by n percent, "hold" and "resume" stop and restart the job
 
-    int d;
+void ocommand(char *s) {
+    double v;
 
-    fd = open(tty, O_RDWR | O_NOCTTY | O_SYNC);
-    if (fd < 0) {
-        perror(MODEM);
-        exit(-1);
+    s += strspn(s, " \t");
+    if (strncmp(s, "hold", 4) == 0) {
+	sethold(1);
+	return;
+    } else if (strncmp(s, "resume", 6) == 0) {
+	sethold(0);
+	return;
     }
+    if (sscanf(s, "%lf", &v) != 1) {
+	return;
+    }
+    if (*s == '+' || *s == '-') {
+	setovr(otarget * 100.0 + v);
+    } else {
+	setovr(v);
+    }
+}
 
-    tcgetattr(fd, &oldtio);     /* save current settings */
+// open the terminal for keys and the control socket
 
-    bzero(&newtio, sizeof(newtio));
-    newtio.c_cflag = BAUD|CS8|CREAD|CRTSCTS;
-    newtio.c_iflag = IGNPAR;
-    newtio.c_oflag = 0;
-    newtio.c_lflag = 0; /* non-canonical, no echo, ... */
+void oopen() {
+    struct termios tio;
+    struct sockaddr_un sa;
 
-    newtio.c_cc[VTIME]=TIMEOUT; /* inter-char timer decisecs */
-    newtio.c_cc[VMIN]=0;        /* block till n chars read */
+    if (keys) {
+	if ((ktty = open("/dev/tty", O_RDONLY | O_NONBLOCK)) < 0) {
+	    fprintf(stderr, "can't open /dev/tty for keys\n");
+	    exit(1);
+	}
+	tcgetattr(ktty, &ktio);
+	tio = ktio;
+	tio.c_lflag &= ~(ICANON | ECHO);
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	tcsetattr(ktty, TCSANOW, &tio);
+    }
+    if (oname != NULL) {
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, oname, sizeof(sa.sun_path) - 1);
+	unlink(oname);
+	if ((osock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    bind(osock, (struct sockaddr *) &sa, sizeof(sa)) < 0 ||
+	    listen(osock, 4) < 0) {
+	    fprintf(stderr, "can't open control socket %s\n", oname);
+	    exit(1);
+	}
+	fcntl(osock, F_SETFL, O_NONBLOCK);
+    }
+}
 
-    tcflush(fd, TCIFLUSH);
-    tcsetattr(fd, TCSANOW, &newtio);
+void oclose() {
+    if (ktty >= 0) {
+	tcsetattr(ktty, TCSANOW, &ktio);
+	close(ktty);
+    }
+    if (osock >= 0) {
+	if (oconn >= 0) {
+	    close(oconn);
+	}
+	close(osock);
+	unlink(oname);
+    }
+}
 
-    // must be opened "a+" instead of "r+" to avoid
-    // "illegal seek error"...
+// take override requests from the keys and the control socket, one
+// connection at a time
 
-    pfd = fdopen(fd, "a+");
+void control() {
+    char c, *nl;
+    int k, n;
 
-    if (pfd == NULL) {
-      printf("can't open %s!\n", tty);
-      exit (1);
+    if (ktty >= 0) {
+	while (read(ktty, &c, 1) == 1) {
+	    if (c == '+' || c == '=') {
+		setovr(otarget * 100.0 + 10.0);
+	    } else if (c == '-') {
+		setovr(otarget * 100.0 - 10.0);
+	    } else if (c == '0') {
+		setovr(100.0);
+	    } else if (c == 'h' || c == ' ') {
+		sethold(!hold);
+	    }
+	}
+    }
+    if (osock >= 0 && oconn < 0 && (oconn = accept(osock, NULL, NULL)) >= 0) {
+	fcntl(oconn, F_SETFL, O_NONBLOCK);
+	nobuf = 0;
     }
+    if (oconn >= 0) {
+	while ((k = read(oconn, obuf + nobuf, sizeof(obuf) - 1 - nobuf)) > 0) {
+	    nobuf += k;
+	    obuf[nobuf] = '\0';
+	    while ((nl = strchr(obuf, '\n')) != NULL) {
+		*nl = '\0';
+		ocommand(obuf);
+		n = nl + 1 - obuf;
+		memmove(obuf, nl + 1, nobuf - n + 1);
+		nobuf -= n;
+	    }
+	    if (nobuf == sizeof(obuf) - 1) {
+		nobuf = 0;		// too long to be a command
+	    }
+	}
+	if (k == 0) {
+	    if (nobuf > 0) {
+		ocommand(obuf);
+	    }
+	    close(oconn);
+	    oconn = -1;
+	}
+    }
+}
 
+// hold back while window or more bytes are on the way to the firmware,
+// or tmax or more ticks of motion
+
+void throttle() {
+    while ((window > 0 && sent - status_taken(&st, base, sent) >= window) ||
+	   (tmax > 0 && ahead() >= tmax)) {
+	fflush(pfd);
+	if (override) {
+	    control();
+	}
+	if (telemetry(1000) == 0) {
+	    fprintf(stderr, "\nno status from the firmware, "
+		"sending without a window\n");
+	    window = 0;
+	    tmax = 0;
+	    return;
+	}
+    }
+}
+
+// send a byte to the firmware within the window
+
+void put(int c) {
+    if (window > 0 || tmax > 0) {
+	throttle();
+    } else if ((sent & 63) == 0) {
+	telemetry(0);
+    }
+    if (override && (sent & 63) == 0) {
+	control();
+    }
+    tring[sent % TRING] = tput.ticks;
+    tickcount(&tput, c);
+    myputchar(c);
+    sent++;
+}
+
+// send the idle ticks held back, rescaled to the override.  Before a
+// step the whole interval up to it is scaled, the firmware's tick for
+// the step included, so the step rate follows ovr exactly; what is
+// lost to whole ticks carries over to the next interval.
+
+void oflush(int step) {
+    double t = (opend + step) / ovr - step + ocarry;
+    long k = (t > 0.0) ? (long) t : 0;
+
+    ocarry = (t - k < -1.0) ? -1.0 : t - k;
+    otick += k + step;
+    for (; k > 127; k -= 127) {
+	put(127);
+    }
+    if (k > 0) {
+	put(k);
+    }
+    opend = 0;
+}
+
+// step axis a at planned tick t, returns 1 if it is steady: it has
+// taken the last m steps in the same time as the m before, to within
+// the ticks they are rounded to.  m is enough steps that what that
+// misses, scaled by OMAX squared, is still within amax.
+
+int axstep(int a, long t) {
+    long k = nhist[a]++;
+    long *h = hist[a];
+    double n, as;
+    long m;
+
+    h[k % (NHIST+1)] = t;
+    if (k < 4) {
+	return (0);
+    }
+    n = (t - h[(k - 4) % (NHIST+1)]) / 4.0;	// ticks a step
+    as = amax / (res * FIRQ * FIRQ);		// steps/tick^2
+    m = (long) ceil(sqrt(2.0 * OMAX * OMAX / (as * n * n * n)));
+    if (m < 4) {
+	m = 4;
+    }
+    if (2 * m > k || 2 * m > NHIST) {
+	return (0);
+    }
+    return (labs((t - h[(k - m) % (NHIST+1)]) -
+	(h[(k - m) % (NHIST+1)] - h[(k - 2*m) % (NHIST+1)])) <= 2);
+}
+
+// read ahead LOOKAHEAD planned ticks, marking what isn't steady: steps
+// of an axis that is speeding up, slowing down or just started, and
+// loops.  An axis starts again after a direction or mode change.
+
+void lookfill() {
+    long i;
+    int a, c, bad;
+
+    while (!leof && nlook - nused < LOOKBUF &&
+	   lnow.ticks - (nused < nlook ? lticks[nused % LOOKBUF] : lnow.ticks) < LOOKAHEAD) {
+	if ((c = getchar()) == EOF) {
+	    leof = 1;
+	    break;
+	}
+	i = nlook % LOOKBUF;
+	bad = 0;
+	if (lnow.skip == 0) {
+	    if ((c&0xf0) == 0x80) {		// dir
+		for (a = 0; a < 4; a++) {
+		    if (((c ^ ldirs) >> a) & 1) {
+			nhist[a] = 0;
+		    }
+		}
+		ldirs = c & 0x0f;
+	    } else if ((c&0xf0) == 0x90) {	// step
+		for (a = 0; a < 4; a++) {
+		    if (((c >> a) & 1) && !axstep(a, lnow.ticks + 1)) {
+			bad = 1;
+		    }
+		}
+	    } else if (c >= 0xa0) {		// mode, loop
+		nhist[0] = nhist[1] = nhist[2] = nhist[3] = 0;
+		bad = (c == 0xb0 || c == 0xb1);
+	    }
+	}
+	look[i] = c;
+	lticks[i] = lnow.ticks;
+	lbad[i] = bad;
+	tickcount(&lnow, c);
+	if (lflag == nlook && !bad) {
+	    lflag++;
+	}
+	nlook++;
+    }
+}
+
+// the next byte, read ahead
+
+int lookget() {
+    int c;
+
+    lookfill();
+    if (nused == nlook) {
+	return (EOF);
+    }
+    c = look[nused % LOOKBUF];
+    lbadnow = lbad[nused % LOOKBUF];
+    nused++;
+    if (lflag < nused) {
+	for (lflag = nused; lflag < nlook && !lbad[lflag % LOOKBUF]; lflag++) {
+	    ;
+	}
+    }
+    return (c);
+}
+
+// the most override at planned speed v that can still ramp down to
+// 100% at amax before the next step read ahead that isn't steady, or
+// before what hasn't been read
+
+double ocap(double v) {
+    long d;
+    double cap;
+
+    if (lbadnow) {
+	return (1.0);
+    }
+    d = ((lflag < nlook) ? lticks[lflag % LOOKBUF] : lnow.ticks) -
+	((nused < nlook) ? lticks[nused % LOOKBUF] : lnow.ticks);
+    cap = 1.0 + amax * d / (v * OMAX * FIRQ);
+    return ((cap < OMAX) ? cap : OMAX);
+}
+
+// move the override towards the one asked for, or down on a hold,
+// but no faster than amax allows at the planned speed of a step n
+// ticks after the last, and over 100% no more than ocap() allows.
+// Returns 1 once a hold has slowed the motion
+// to a speed it can stop from dead, amax*res as at a resume point; a
+// hold goes below OMIN if it has to.  Loop bodies are replayed by the
+// firmware as sent, so a ramp in one would be a velocity step at every
+// wrap: the override holds still inside a loop, and a hold waits until
+// the loop is out.
+
+int oramp(long n) {
+    double v = res * FIRQ / n;		// planned speed
+    double dv = amax * (n / (ovr * FIRQ)) / v;
+    double ostop = amax * res / v;	// override slow enough to stop
+    double cap = ocap(v);
+    double to = (otarget < cap) ? otarget : cap;
+
+    if (oloop) {
+	return (0);
+    } else if (hold) {
+	if (ovr > ostop) {
+	    ovr = (ovr - dv > ostop) ? ovr - dv : ostop;
+	}
+	return (ovr <= ostop);
+    } else if (to > ovr) {
+	ovr = (ovr + dv < to) ? ovr + dv : to;
+    } else {
+	ovr = (ovr - dv > to) ? ovr - dv : to;
+    }
+    if (ovr > cap) {
+	ovr = cap;
+    }
+    return (0);
+}
+
+// a hold has ramped the motion down: send nothing until resumed, and
+// time from the status frames how long the firmware took to run out
+// what it had.  That is bounded by tmax (-m) at the old rate, what
+// was ahead of it when the hold was asked for, then the ramp.
+
+void ostop() {
+    double tramp = (otick - khold) / FIRQ;
+    int still = 0;
+
+    fflush(pfd);
+    while (hold) {
+	control();
+	if (telemetry(50) > 0 && !still && status_taken(&st, base, sent) == sent &&
+	    st.rxfill == 0 && st.ticks == 0) {
+	    still = 1;
+	    fprintf(stderr, "\nhold: stopped %.0f ms after the request, "
+		"%lu bytes %.0f ms ahead then", (now() - thold) * 1000.0,
+		qhold, tqhold * 1000.0 / FIRQ);
+	    if (tmax > 0) {
+		fprintf(stderr, " (bound %.0f ms)", tmax * 1000.0 / FIRQ);
+	    }
+	    fprintf(stderr, ", ramp %.0f ms\n", tramp * 1000.0);
+	}
+    }
+    if (!still) {
+	fprintf(stderr, "\nhold: resumed before the firmware stopped\n");
+    }
+}
+
+// skip to the first point at or after input line sline where the
+// planned speed is low enough to start from rest (within the amax*res
+// velocity jump velo allows at corners), then plan a lead-in move
+// from cur[] to it that ends at rest.  The job may carry on in any
+// direction, so arriving at vs could jump by up to 2*vs.  Returns the byte offset resumed at, and the
+// machine position there in loc[].
+
+long resume(FILE *in, int *loc) {
+    FILE *fx;
+    char line[256];
+    double r[4];
+    double fstep = FIRQ;
+    double rmin, vjump, vs, l;
+    long off, k;
+    int n, dir, m;
+    int fm = -1;		// mode the index positions count in
+    int found = 0;
+
+    if ((fx = fopen(xname, "r")) == NULL) {
+	fprintf(stderr, "can't open index %s\n", xname);
+	exit(1);
+    }
+    r[0] = r[1] = r[2] = r[3] = res;
+    while (fgets(line, sizeof(line), fx) != NULL) {
+	if (line[0] == '#') {
+	    sscanf(line, "# res %lf %lf %lf %lf fstep %lf mode %d", 
+		&r[0], &r[1], &r[2], &r[3], &fstep, &fm);
+	    continue;
+	}
+	rmin = min(min(r[0], r[1]), min(r[2], r[3]));
+	vjump = amax * rmin;
+	if (sscanf(line, "%d %ld %d %d %d %d %x %d %lf", &n, &off, 
+		&loc[0], &loc[1], &loc[2], &loc[3], &dir, &m, &vs) == 9 &&
+		n >= sline && vs <= vjump) {
+	    found++;
+	    break;
+	}
+    }
+    fclose(fx);
+    if (!found) {
+	fprintf(stderr, "no resume point at or after line %d in %s\n", 
+	    sline, xname);
+	exit(1);
+    }
+
+    // seek the byte codes, or read past them on a pipe
+
+    if (fseek(in, off, SEEK_SET) != 0) {
+	for (k = 0; k < off; k++) {
+	    if (getc(in) == EOF) {
+		fprintf(stderr, "byte code input ends before %ld\n", off);
+		exit(1);
+	    }
+	}
+    }
+
+    // lead-in from where the machine is, stopping there.  The lead-in
+    // steps in the index's units, then the byte codes carry on
+    // in the mode velo had picked for the resume point.
+
+    xres = r[0]; yres = r[1]; zres = r[2]; wres = r[3];
+    xloc = cur[0]; yloc = cur[1]; zloc = cur[2]; wloc = cur[3];
+    l = sqrt(pow((loc[0] - cur[0]) * xres, 2.0) + 
+	     pow((loc[1] - cur[1]) * yres, 2.0) +
+	     pow((loc[2] - cur[2]) * zres, 2.0) + 
+	     pow((loc[3] - cur[3]) * wres, 2.0));
+    bc_output(pfd);
+    if (fm < 0) {
+	fm = m;
+    }
+    mode(fm);
+    if (l > 0.0) {
+	setseg(l, 0.0, 0.0, vmax, amax, 0.0, rmin, fstep);
+	dda(segprofile(), loc[0], loc[1], loc[2], loc[3], fstep);
+    }
+    if (m != fm) {
+	mode(m);
+    }
     fflush(pfd);
-    return(fd);
+
+    fprintf(stderr, "resuming at line %d, byte %ld, lead-in %g inches\n", 
+	n, off, l);
+    return (off);
+}
+
+// fan-out: one byte code stream to several controllers, -p given
+// more than once.  The input is kept in memory and every device has
+// its own place in it, window and status, and is written without
+// blocking, so a slow or stalled device falls behind on its own
+// instead of holding up the others.  Each device's lag is the motion
+// time it has left to catch up with the one furthest along.
+
+#define NDEV 8			// most devices
+#define TICKIDX 256		// input bytes between tick marks
+#define FANAHEAD (16L << 20)	// most input read ahead of the slowest
+
+typedef struct device {
+    char *name;
+    FILE *f;
+    int fd;
+    int dead;			// write failed
+    STATUS st;
+    unsigned long sent;		// bytes written
+    unsigned long base;		// firmware byte count when we started
+    unsigned long dry;		// ticks it ran dry during the job
+    int running;		// it has started stepping
+    long home[4];
+    long done;			// ticks of the job it has run
+    long maxlag;		// most ticks behind the leader
+} DEVICE;
+
+char *devs[NDEV];
+int ndev = 0;
+DEVICE fan[NDEV];
+
+unsigned char *in = NULL;	// the byte codes from ibase on
+unsigned long ibase = 0;	// what every live device is past
+unsigned long nin = 0;		// bytes read
+unsigned long size = 0;		// room in in[]
+unsigned long nmarks = 0;	// room in marks[]
+
+// ticks the byte codes take up to every TICKIDX bytes, kept from the
+// start for the lag
+
+TICKMARK *marks = NULL;
+TICKMARK tnow;			// at nin
+
+// ticks up to byte off of the input
+
+long tickat(unsigned long off) {
+    TICKMARK m;
+    unsigned long i;
+
+    if (off > nin) {
+	off = nin;
+    }
+    m = marks[off / TICKIDX];
+    for (i = off - off % TICKIDX; i < off; i++) {
+	tickcount(&m, in[i - ibase]);
+    }
+    return (m.ticks);
+}
+
+// read back the status frames of device d
+
+void fanstatus(DEVICE *d) {
+    unsigned char buf[256];
+    unsigned int idle;
+    int k, i;
+
+    while ((k = read(d->fd, buf, sizeof(buf))) > 0) {
+	for (i = 0; i < k; i++) {
+	    idle = d->st.idle;
+	    if (!status_byte(&d->st, buf[i])) {
+		continue;
+	    }
+	    if (d->st.frames == 1) {
+		d->base = d->st.rxcount - d->sent;
+		memcpy(d->home, d->st.pos, sizeof(d->home));
+	    } else if (d->running && (!eof || d->sent > status_taken(&d->st, d->base, d->sent))) {
+		d->dry += (d->st.idle - idle) & 0xffff;
+	    }
+	    d->running |= (d->st.ticks > 0 || memcmp(d->home, d->st.pos, sizeof(d->home)));
+	}
+    }
+}
+
+// bytes device d has taken in, or been sent without status frames
+
+unsigned long fantaken(DEVICE *d) {
+    return ((d->st.frames > 0) ? status_taken(&d->st, d->base, d->sent) : d->sent);
+}
+
+// the oldest byte a live device may still need, for its lag
+
+unsigned long fanneed(DEVICE *d) {
+    unsigned long t = fantaken(d);
+
+    if (d->st.frames > 0 && t >= d->st.rxfill) {
+	t -= d->st.rxfill;
+    } else if (d->st.frames > 0) {
+	t = 0;
+    }
+    return ((t < d->sent) ? t : d->sent);
+}
+
+// the bytes every live device is past, to a mark
+
+unsigned long fanlow() {
+    unsigned long low = nin;
+    int i;
+
+    for (i = 0; i < ndev; i++) {
+	if (!fan[i].dead && fanneed(&fan[i]) < low) {
+	    low = fanneed(&fan[i]);
+	}
+    }
+    return (low - low % TICKIDX);
+}
+
+// take what stdin has, returns 0 at its end
+
+int fanin() {
+    unsigned long i, low;
+    int k;
+
+    if (nin - ibase + 65536 > size && (low = fanlow()) - ibase >= (nin - ibase) / 2) {
+	memmove(in, in + (low - ibase), nin - low);	// drop what all are past
+	ibase = low;
+    }
+    if (nin - ibase + 65536 > size) {
+	size = 2 * size + 65536;
+	if ((in = (unsigned char *) realloc(in, size)) == NULL) {
+	    fprintf(stderr, "out of memory for the byte codes\n");
+	    exit(1);
+	}
+    }
+    if ((nin + 65536) / TICKIDX + 1 > nmarks) {
+	nmarks = 2 * nmarks + 65536 / TICKIDX + 1;
+	if ((marks = (TICKMARK *) realloc(marks, nmarks * sizeof(TICKMARK))) == NULL) {
+	    fprintf(stderr, "out of memory for the byte codes\n");
+	    exit(1);
+	}
+    }
+    if ((k = read(0, in + (nin - ibase), 65536)) <= 0) {
+	return (0);
+    }
+    for (i = nin; i < nin + k; i++) {
+	if (i % TICKIDX == 0) {
+	    marks[i / TICKIDX] = tnow;
+	}
+	tickcount(&tnow, in[i - ibase]);
+    }
+    nin += k;
+    if (nin % TICKIDX == 0) {
+	marks[nin / TICKIDX] = tnow;
+    }
+    return (1);
+}
+
+// the device has everything and has run it out
+
+int fandone(DEVICE *d) {
+    return (d->dead || (eof && d->sent == nin && (d->st.frames == 0 ||
+	(fantaken(d) == d->sent && d->st.rxfill == 0 && d->st.ticks == 0))));
+}
+
+// work out how far along each device is, and show it
+
+void fanshow() {
+    DEVICE *d;
+    long lead = 0;
+    int i;
+
+    for (i = 0; i < ndev; i++) {
+	d = &fan[i];
+	if (d->dead) {
+	    ;				// its bytes may be gone
+	} else if (d->st.frames > 0 && fantaken(d) >= d->st.rxfill) {
+	    d->done = tickat(fantaken(d) - d->st.rxfill) - d->st.ticks;
+	} else if (d->st.frames == 0) {
+	    d->done = tickat(d->sent);
+	}
+	if (d->done > lead) {
+	    lead = d->done;
+	}
+    }
+    for (i = 0; i < ndev; i++) {
+	d = &fan[i];
+	if (!d->dead && lead - d->done > d->maxlag) {
+	    d->maxlag = lead - d->done;
+	}
+	fprintf(stderr, "%s[%d %.1fs lag %.0fms]", i ? " " : "  ", i,
+	    d->done / FIRQ, d->dead ? -1.0 : (lead - d->done) * 1000.0 / FIRQ);
+    }
+    fprintf(stderr, "\r");
+    fflush(stderr);
+}
+
+// returns the number of devices dropped
+
+int fanout() {
+    struct pollfd p[NDEV + 1];
+    DEVICE *d;
+    double tshow = 0.0;
+    struct timespec ts;
+    unsigned long room;
+    int i, k, np, alldone;
+    int rd;			// reading the input
+    int failed = 0;
+
+    for (i = 0; i < ndev; i++) {
+	d = &fan[i];
+	d->name = devs[i];
+	d->f = serial_open(d->name, baud);
+	d->fd = fileno(d->f);
+	fcntl(d->fd, F_SETFL, O_NONBLOCK);
+    }
+    fanin();
+
+    // give each device half a second to send a first frame, those
+    // that don't are sent to blind
+
+    for (k = 0; k < 10; k++) {
+	for (i = 0; i < ndev; i++) {
+	    p[i].fd = fan[i].fd;
+	    p[i].events = POLLIN;
+	}
+	poll(p, ndev, 50);
+	for (i = 0; i < ndev; i++) {
+	    fanstatus(&fan[i]);
+	}
+    }
+
+    for (;;) {
+	// the input, and every device that can take more or has
+	// something to say
+
+	np = 0;
+	if ((rd = !eof && nin - fanlow() < FANAHEAD)) {
+	    p[np].fd = 0;
+	    p[np++].events = POLLIN;
+	}
+	for (i = 0; i < ndev; i++) {
+	    d = &fan[i];
+	    p[np].fd = fandone(d) ? -1 : d->fd;
+	    p[np].events = POLLIN;
+	    if (d->sent < nin && 
+		(d->st.frames == 0 || window == 0 || d->sent - fantaken(d) < window)) {
+		p[np].events |= POLLOUT;
+	    }
+	    p[np++].revents = 0;
+	}
+	poll(p, np, 50);
+
+	if (rd && (p[0].revents & (POLLIN | POLLHUP)) && !fanin()) {
+	    eof = 1;
+	}
+	for (i = 0; i < ndev; i++) {
+	    d = &fan[i];
+	    k = np - ndev + i;
+	    if (p[k].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		fprintf(stderr, "\n%s: link lost, dropped\n", d->name);
+		d->dead = 1;
+		continue;
+	    }
+	    if (p[k].revents & POLLIN) {
+		fanstatus(d);
+	    }
+	    if (p[k].revents & POLLOUT) {
+		room = nin - d->sent;
+		if (d->st.frames > 0 && window > 0 && room > window - (d->sent - fantaken(d))) {
+		    room = window - (d->sent - fantaken(d));
+		}
+		if ((k = write(d->fd, in + (d->sent - ibase), room)) > 0) {
+		    d->sent += k;
+		} else if (k < 0 && errno != EAGAIN) {
+		    fprintf(stderr, "\n%s: %s, dropped\n", d->name, strerror(errno));
+		    d->dead = 1;
+		}
+	    }
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (ts.tv_sec + ts.tv_nsec * 1e-9 - tshow > 0.25) {
+	    tshow = ts.tv_sec + ts.tv_nsec * 1e-9;
+	    fanshow();
+	}
+
+	alldone = eof;
+	for (i = 0; i < ndev; i++) {
+	    alldone &= fandone(&fan[i]);
+	}
+	if (alldone) {
+	    break;
+	}
+    }
+
+    fanshow();
+    fprintf(stderr, "\n");
+    for (i = 0; i < ndev; i++) {
+	d = &fan[i];
+	fprintf(stderr, "%s: %s %lu bytes, %ld status frames, dry %lu ticks, most lag %.0fms\n",
+	    d->name, d->dead ? "FAILED after" : "sent", d->sent, d->st.frames,
+	    d->dry, d->maxlag * 1000.0 / FIRQ);
+	serial_close(d->f);
+	failed += d->dead;
+    }
+    return (failed);
+}
+
+int main(int argc, char **argv) {
+   int c;
+   long w = -1;			// -w, -1 if not given
+   int xdir, ydir, zdir, wdir;
+   int xloc, yloc, zloc, wloc;
+   long n;
+   int stop;
+
+   extern int optind;
+   extern char *optarg;
+   int errflg = 0;
+
+   while ((c = getopt(argc, argv, "a:b:c:i:km:o:p:r:s:v:w:")) != EOF) {
+       switch (c) {
+       case 'a':			// lead-in acceleration
+	   amax = atof(optarg);
+	   break;
+       case 'b':			// link baud rate
+	   baud = atoi(optarg);
+	   break;
+       case 'c':			// current machine position
+	   if (sscanf(optarg, "%d,%d,%d,%d", 
+	   	&cur[0], &cur[1], &cur[2], &cur[3]) < 2) {
+	       errflg = 1;
+	   }
+	   break;
+       case 'i':			// resume index
+	   xname = optarg;
+	   break;
+       case 'k':			// override from the keyboard
+	   keys = 1;
+	   override = 1;
+	   break;
+       case 'm':			// most motion time ahead with an override
+	   tahead = atof(optarg);
+	   break;
+       case 'o':			// override control socket
+	   oname = optarg;
+	   override = 1;
+	   break;
+       case 'p':			// serial device, more than one fans out
+	   dev = optarg;
+	   if (ndev < NDEV) {
+	       devs[ndev] = optarg;
+	   }
+	   ndev++;
+	   break;
+       case 'r':			// step size of the job
+	   res = atof(optarg);
+	   break;
+       case 's':			// resume at input line
+	   sline = atoi(optarg);
+	   break;
+       case 'v':			// lead-in velocity
+	   vmax = atof(optarg);
+	   break;
+       case 'w':			// flow control window
+	   w = atol(optarg);
+	   break;
+       default:
+	   errflg = 1;
+	   break;
+       }
+   }
+
+   if (ndev > 1 && (xname != NULL || override)) {
+       fprintf(stderr, "%s error: no -i, -k or -o with more than one -p\n", argv[0]);
+       errflg = 1;
+   }
+   if (sline != 0 && xname == NULL) {
+       fprintf(stderr, "%s error: -s needs a resume index, -i\n", argv[0]);
+       errflg = 1;
+   }
+   if (errflg || baud <= 0 || amax <= 0.0 || vmax <= 0.0 || res <= 0.0 || w < -1 ||
+       tahead < 0.0 || ndev > NDEV) {
+       fprintf(stderr, "usage: %s [options] < bytecodes\n", argv[0]);
+       fprintf(stderr, "     -a <amax>  ; lead-in and override acceleration\n");
+       fprintf(stderr, "     -b <baud>  ; link baud rate (default %d)\n", SERIAL_BAUD);
+       fprintf(stderr, "     -c <x,y,z,w> ; machine position in steps (default 0)\n");
+       fprintf(stderr, "     -i <index> ; resume index written by velo -x\n");
+       fprintf(stderr, "     -k         ; override feed rate with keys: + - 10%%, 0 100%%,\n");
+       fprintf(stderr, "                  h or space hold and resume\n");
+       fprintf(stderr, "     -m <ms>    ; with -k or -o, most motion time ahead of the firmware\n");
+       fprintf(stderr, "                  (default %.0f, 0=any), bounds a hold\n", TAHEAD);
+       fprintf(stderr, "     -o <path>  ; override control socket, lines of <pct>, +/-<pct>,\n");
+       fprintf(stderr, "                  hold or resume\n");
+       fprintf(stderr, "     -p <dev>   ; serial device (default %s), repeat to fan out\n", SERIAL_DEV);
+       fprintf(stderr, "                  to up to %d devices\n", NDEV);
+       fprintf(stderr, "     -r <res>   ; step size velo planned for, for -k and -o ramps\n");
+       fprintf(stderr, "                  and the display (default %g)\n", RES);
+       fprintf(stderr, "     -s <line>  ; resume at input line\n");
+       fprintf(stderr, "     -v <vmax>  ; lead-in velocity\n");
+       fprintf(stderr, "     -w <bytes> ; most bytes ahead of the firmware (default %d, 0=any)\n", WINDOW);
+       exit(1);
+   }
+
+   if (ndev > 1) {
+       window = (w < 0) ? WINDOW : w;
+       return(fanout() > 0);	// 1 if any device was dropped
+   }
+
+   pfd = serial_open(dev, baud);
+   if (override) {
+       oopen();
+   }
+
+   // the first frame gives the firmware's byte count to start from.
+   // Once it is talking, stay within a window even if none was asked
+   // for, so feed keeps reading instead of sitting in a blocked write.
+
+   if (telemetry(w > 0 ? 500 : 100) == 0) {
+       if (w > 0) {
+	   fprintf(stderr, "no status from the firmware, sending without a window\n");
+       }
+   } else {
+       window = (w < 0) ? WINDOW : w;
+   }
+   if (override && st.frames > 0) {
+       tmax = (long) (tahead * FIRQ / 1000.0);
+   }
+
+   xdir = ydir = zdir = wdir = 0;
+   xloc = yloc = zloc = wloc = 0;
+
+   if (xname != NULL) {
+       int loc[4];
+
+       resume(stdin, loc);
+       xloc = loc[0]; yloc = loc[1]; zloc = loc[2]; wloc = loc[3];
+       sent = bc_tell();
+       tfirst = sent;
+   }
+
+   while((c = override ? lookget() : getchar()) != EOF) {
+
+       if ((c&0xf0) == 0x80) {		// dir
+	   xdir = ydir = zdir = wdir = -1;
+           if (c&XMASK) xdir=1;
+           if (c&YMASK) ydir=1;
+           if (c&ZMASK) zdir=1;
+           if (c&WMASK) wdir=1;
+       } else if ((c&0xf0) == 0x90) {	// step
+           if (c&XMASK) xloc+=xdir;
+           if (c&YMASK) yloc+=ydir;
+           if (c&ZMASK) zloc+=zdir;
+           if (c&WMASK) wloc+=wdir;
+	   if (st.frames == 0) {	// else the firmware's position
+	       fprintf(stderr,"  [X: %#8.4f] [Y: %#8.4f] [Z: %#8.4f] [W: %#8.4f]\r", 
+		   xloc*res, yloc*res, zloc*res, wloc*res);
+	       fflush(stderr);
+	   }
+       }
+
+       // with an override the delays are held until the next code
+       // and sent rescaled; the run count after an ENDL isn't a delay
+
+       stop = 0;
+       if (override) {
+	   if (oskip > 0) {
+	       oskip--;
+	   } else if (c < 0x80) {
+	       opend += c;
+	       continue;
+	   } else {
+	       n = opend + 1;
+	       oflush((c&0xf0) == 0x90);
+	       if ((c&0xf0) == 0x90) {
+		   stop = oramp(n);
+	       }
+	       if (c == 0xb0) {		// LOOP
+		   oloop = 1;
+	       } else if (c == 0xb1) {	// ENDL
+		   oskip = 2;
+		   oloop = 0;
+	       }
+	   }
+       }
+       put(c);
+       if (stop) {
+	   ostop();
+       }
+   }
+   if (override) {
+       oflush(0);
+   }
+
+   // watch the firmware run out what it has
+
+   eof = 1;
+   fflush(pfd);
+   while (st.frames > 0 && telemetry(1000) > 0 && 
+       (status_taken(&st, base, sent) != sent || st.rxfill > 0 || st.ticks > 0)) {
+       ;
+   }
+   serial_close(pfd);
+   if (override) {
+       oclose();
+   }
+   fprintf(stderr,"\n");
+   return(0);
 }
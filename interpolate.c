@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "profile.h"
+#include "bytecodes.h"
+
 #define XMASK 1
 #define YMASK 2
 #define ZMASK 4
@@ -12,12 +15,20 @@ static double vm;		// peak velocity value for segment
 static double lseg;		// length of this segment
 static double s1,s2,s3;		// distances of rampup,constant,rampdown
 static double ts1, ts2;		// time to reach s1,s2
+static double tseg;		// time to reach lseg
 static double vmax;
 static double amax;
+static double jmax;		// jerk limit, 0 for a trapezoid
 static double res;
 static int pen;
 static double fupdate;		// pic (servo) interrupt frequency
 
+// the current segment as a one entry profile
+
+static PROFILE seg = {
+    1, &lseg, &vs, &ve, &vmax, &amax, &vm, &s1, &s2, &s3, &ts1, &ts2, &tseg, &jmax
+};
+
 extern int debug;
 
 int xloc=0;			// actual step counts
@@ -25,6 +36,11 @@ int yloc=0;
 int zloc=0;
 int wloc=0;
 
+double xres=0.0001;		// step size of each axis
+double yres=0.0001;
+double zres=0.0001;
+double wres=0.0001;
+
 double max(double a, double b)
 {
     if (a > b) return a;
@@ -41,35 +57,34 @@ double min(double a, double b)
 
 void setseg(double llseg, 
             double vvs, double vve, 
-	    double vvmax, double aamax, 
+	    double vvmax, double aamax, double jjmax,
 	    double rres, double f) {
 
     vs = vvs; ve = vve;
     vmax=vvmax;
     amax=aamax;
+    jmax=jjmax;
     res=rres;
     lseg=llseg;
     fupdate=f;
 
-    // peak velocity for this segment
-    vm = min(vmax, sqrt((pow(vs,2.0) + pow(ve,2.0) + 2.0*amax*lseg)/2.0));
-
-    // ramp up distance (s1), constant v (s2) and ramp down (s3)
-    s1 = (vm*vm-vs*vs)/(2.0*amax); if (fabs(s1) < res/100.0) s1 = 0.0;
-    s3 = (vm*vm-ve*ve)/(2.0*amax); if (fabs(s3) < res/100.0) s3 = 0.0;
-    s2 = lseg-s1-s3; if (fabs(s2) < res/100.0) s2 = 0.0;
-
-    // time to reach s1, s2
-    ts1 = (sqrt(vs*vs+2.0*amax*s1)-vs)/amax;
-    ts2 = ts1 + s2/vm;
+    // peak velocity, ramp up distance (s1), constant v (s2) and ramp
+    // down (s3) and the time to reach s1, s2
+    profile_solve(&seg, res);
 
     if (debug & 1) {
-     fprintf(stderr,"#setseg: lseg:%g vmax:%g amax:%g vs:%g \
+     fprintf(stderr,"#setseg: lseg:%g vmax:%g amax:%g jmax:%g vs:%g \
      ve:%g vm:%g s1:%g s2:%g s3:%g ts1:%g ts2:%g\n", 
-     lseg, vmax, amax, vs, ve, vm, s1, s2, s3, ts1, ts2);
+     lseg, vmax, amax, jmax, vs, ve, vm, s1, s2, s3, ts1, ts2);
     }
 }
 
+// the profile of the current segment, for the other step engines
+
+PROFILE *segprofile() {
+    return (&seg);
+}
+
 // return the time it takes to get to fraction alpha of this segment
 double time2alpha(double alpha) {
 
@@ -84,16 +99,7 @@ double time2alpha(double alpha) {
 	 clipped++;
       }
 
-      if (l < s1) {             // accellerating
-         tt = (sqrt(vs*vs+2.0*amax*l)-vs)/amax;
-	 pen = 2;
-      } else if (l < s1+s2) {   // cruising
-         tt = ts1 + (l-s1)/vm;
-	 pen = 3;
-      } else {                  // decellerating
-         tt = ts2 + (vm - sqrt(fabs(vm*vm - 2.0*amax*(l-(s2+s1)))))/amax;
-	 pen = 4;
-      }
+      tt = profile_time(&seg, 0, l, &pen);
       if (debug & 1) {
         printf("atl: alpha:%g l:%g s1:%g s2:%g ts1:%g ts2:%g vm:%g amax:%g tt:%g\n", 
         alpha, l, s1, s2, ts1, ts2, vm, amax, tt);
@@ -117,7 +123,7 @@ double interpolate(double x1, double y1, double z1, double w1,
     int minstep = 0;
     int minstep2 = 0;
     int xstep, ystep, zstep, wstep;	// next step counts
-    int delay;
+    int dly;
     int done;
 
     unsigned char mask;		// bit mask for advancing xyzw
@@ -141,7 +147,7 @@ double interpolate(double x1, double y1, double z1, double w1,
     if (debug&4) {
 	fprintf(stderr,"DIR 0x%.2x\n", dirmask);
     } else {
-        putchar(0x80 | dirmask);
+        dirs(dirmask);
     }
 
 // DELY    (7:0) '0'nnn nnnn  ; delay n+1 counts
@@ -156,10 +162,10 @@ double interpolate(double x1, double y1, double z1, double w1,
     w0 = w1;
 
     stepmask = 0;
-    if (fabs(x2-x1) > 0.5*res) stepmask |= XMASK;
-    if (fabs(y2-y1) > 0.5*res) stepmask |= YMASK;
-    if (fabs(z2-z1) > 0.5*res) stepmask |= ZMASK;
-    if (fabs(w2-w1) > 0.5*res) stepmask |= WMASK;
+    if (fabs(x2-x1) > 0.5*xres) stepmask |= XMASK;
+    if (fabs(y2-y1) > 0.5*yres) stepmask |= YMASK;
+    if (fabs(z2-z1) > 0.5*zres) stepmask |= ZMASK;
+    if (fabs(w2-w1) > 0.5*wres) stepmask |= WMASK;
 
     // I assumed the factor 0.0*res below should have
     // been 0.5 to minimize error, but 0.0 empirically
@@ -168,10 +174,10 @@ double interpolate(double x1, double y1, double z1, double w1,
     // redundant...
 
     alphax = alphay = alphaz = alphaw = 0.0;
-    eax = 1.0 - fabs(0.0*res/(x2-x1));
-    eay = 1.0 - fabs(0.0*res/(y2-y1));
-    eaz = 1.0 + fabs(0.0*res/(z2-z1));
-    eaw = 1.0 + fabs(0.0*res/(w2-w1));
+    eax = 1.0 - fabs(0.0*xres/(x2-x1));
+    eay = 1.0 - fabs(0.0*yres/(y2-y1));
+    eaz = 1.0 + fabs(0.0*zres/(z2-z1));
+    eaw = 1.0 + fabs(0.0*wres/(w2-w1));
 
     mask = XMASK | YMASK | ZMASK | WMASK;	// initial step in all dims
     xstep = ystep = zstep = wstep = 0;
@@ -196,7 +202,7 @@ double interpolate(double x1, double y1, double z1, double w1,
 
        if ((alphax < eax) && stepmask & XMASK) {
             if(mask & XMASK) { 
-	       xx+=res*xdir;
+	       xx+=xres*xdir;
 	   } 
 	   alphax = (xx-x1)/(x2-x1);
 	   if (alphax > eax) { 
@@ -210,7 +216,7 @@ double interpolate(double x1, double y1, double z1, double w1,
 
        if ((alphay < eay) && stepmask & YMASK) {
 	   if (mask & YMASK) {
-	       yy+=res*ydir;
+	       yy+=yres*ydir;
 	   }
 	   alphay = (yy-y1)/(y2-y1);
 	   if (alphay > eay) { 
@@ -223,7 +229,7 @@ double interpolate(double x1, double y1, double z1, double w1,
 
        if ((alphaz < eaz) && stepmask & ZMASK) {
        	   if (mask & ZMASK) {
-	       zz+=res*zdir;
+	       zz+=zres*zdir;
 	   } 
            alphaz = (zz-z1)/(z2-z1);
 	   if (alphaz > eaz) { 
@@ -236,7 +242,7 @@ double interpolate(double x1, double y1, double z1, double w1,
 
        if ((alphaw < eaw) && stepmask & WMASK) {
            if (mask & WMASK) {
-	       ww+=res*wdir;
+	       ww+=wres*wdir;
 	   }
 	   alphaw = (ww-w1)/(w2-w1);
 	   if (alphaw > eaw) { 
@@ -293,9 +299,9 @@ double interpolate(double x1, double y1, double z1, double w1,
 	   }
        }
 
-       delay=(minstep-minstep2);
+       dly=(minstep-minstep2);
 
-       if (delay != 0) {
+       if (dly != 0) {
 
 	   // all done, update step locations
 
@@ -312,23 +318,17 @@ double interpolate(double x1, double y1, double z1, double w1,
 	       fprintf(stderr,"DEL %d\n", minstep-minstep2);
 	       fprintf(stderr,"STP 0x%.2x\n", mask);
 	   } else {
-	       delay=(minstep-minstep2);
+	       dly=(minstep-minstep2);
 
-	       if (delay > 5000) { 
+	       if (dly > 5000) { 
 		    if (debug&16) {
-			fprintf(stderr, "clipping bad delay val: %d\n", delay);
+			fprintf(stderr, "clipping bad delay val: %d\n", dly);
 		    }
-		    delay = 5000;		// defensive programming
+		    dly = 5000;		// defensive programming
 	       }
 
-	       while(delay>=128) {
-		  putchar(0x7f);
-		  delay-=128;
-	       }
-	       if (delay > 0) {
-		   putchar(delay&0x7f);
-	       }
-	       putchar(0x90 | mask);
+	       delay(dly);
+	       step(mask);
 	    }
 	}
         minstep2 = minstep;
@@ -1,9 +1,11 @@
 extern void setseg(
     double lseg, double vvs, double vve, 
-    double vvmax, double aamax, double rres, double f); 
+    double vvmax, double aamax, double jjmax, double rres, double f); 
 
 extern double timeatl(double l);
 
+extern struct profile *segprofile(void);
+
 extern double min(double a, double b);
 
 double interpolate(double x1, double y1, double z1, double w1,
@@ -11,3 +13,4 @@ double interpolate(double x1, double y1, double z1, double w1,
 		   double ttotal, double ltotal);
 
 extern int xloc, yloc, zloc, wloc;	// actual step counts
+extern double xres, yres, zres, wres;	// step size of each axis
@@ -7,18 +7,19 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include "stepper.h"
+#include "bytecodes.h"
+#include "serial.h"
 
 // DIR     (7:0) '1000' wzyx  ; direction (0=ccw, 1=cw)
 // STEP    (7:0) '1001' wzyx  ; step (1=step, 0=idle)
 
 struct termios oldtermios;
 
-#define BAUD    B230400       /* baudrate */
 #define _BSD_SOURCE 1
-#define TIMEOUT 1
-#define MODEM "/dev/ttyUSB0"
-
-FILE *init_drip(char *tty);
 
 int ttyraw(int fd)
 {
@@ -101,32 +102,212 @@ void sigcatch(int sig)
     exit(0);
 }
 
-#define STEPRATE 5000 // step rate in HZ
-int count=150;
+// Holding a key jogs one axis.  The host plans the move with the
+// stepper.c trapezoid profile and sends DELAY/STEP byte codes so the
+// firmware sets the step timing.  The terminal only reports key
+// repeats, so a key counts as released when its next repeat is late.
+// At most LEAD seconds of motion are queued ahead of the firmware,
+// which bounds the time from release to the start of the ramp down.
+
+#define FIRQ 19531.0		// firmware step interrupt rate
+#define VMAX 0.5		// default jog speed (inches/second)
+#define AMAX 5.0		// default jog acceleration (inches/second^2)
+#define RES 0.0001		// default step size (inches)
+#define LEG 1.0			// length of each planned leg of a jog
+#define LEAD 0.03		// motion sent ahead of the firmware (seconds)
+#define HOLD1 0.6		// release if the first key repeat is later
+#define HOLD 0.15		// release if a later key repeat is later
+
+#define XMASK 1
+#define YMASK 2
+#define ZMASK 4
+
+double vmax = VMAX;
+double amax = AMAX;
+double res = RES;
+char *dev = SERIAL_DEV;
+int baud = SERIAL_BAUD;
+int debug = 0;
+
+int jmask = 0;			// axis being stepped, 0 = at rest
+int jcw, jsign;			// its direction
+int wmask = 0;			// axis of the key held down, 0 = none
+int wcw, wsign;
+int repeats;			// key repeats seen while held
+double tkey;			// time of the last key press or repeat
+
+STEPPARM sp, *s = &sp;		// current leg of the jog
+int nleg, kleg;			// steps in the leg, steps done
+int stopping;			// leg is the ramp down to rest
+double tleg;			// start of the leg (ticks)
+double tlast;			// exact time of the last step (ticks)
+long long tick;			// ticks sent
+double tstart;			// wall clock at tick 0
+int x, y, z;
+
+double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec + t.tv_nsec * 1e-9);
+}
+
+// start a leg at speed v, either towards vmax or down to rest
 
-int pulse(FILE *dev, int a, int b, int count) {
-    int i;
-    for (i=0; i<count; i++) {
-	fprintf(dev, "%c%c", a, b);
-	fflush(dev);
-	usleep(1000000/STEPRATE);
+void plan(double v, int stop)
+{
+    if (stop) {
+	nleg = (int) ceil(v * v / (2.0 * amax) / res);
+	if (nleg < 1) nleg = 1;
+	stepper_set_parms(s, nleg * res, v, 0.0, amax, v, 0.0, res);
+    } else {
+	nleg = (int) (LEG / res);
+	stepper_set_parms(s, nleg * res, v, vmax, amax, vmax, 0.0, res);
+    }
+    kleg = 0;
+    tleg = tlast;
+    stopping = stop;
+    if (debug) {
+	fprintf(stderr, "leg v:%g stop:%d steps:%d\n\r", v, stop, nleg);
     }
-    return(count);
 }
 
+// send the next step of the current leg
 
-void main()
+void jstep()
 {
-    int i;
+    long long dly;
+
+    kleg++;
+    tlast = tleg + time_at_l(s, kleg * res) * FIRQ;
+    dly = llround(tlast) - tick;
+    if (dly < 1) {
+	dly = 1;
+    }
+    tick += dly;
+    delay((int) dly - 1);		// the step itself takes a tick
+    step(jmask);
+
+    if (jmask == XMASK) x += jsign;
+    if (jmask == YMASK) y += jsign;
+    if (jmask == ZMASK) z += jsign;
+}
+
+// keep LEAD seconds of motion queued, following the key held down
+
+void jog()
+{
+    double v;
+
+    while (tick < (now() - tstart + LEAD) * FIRQ) {
+	if (jmask == 0) {
+	    if (wmask == 0) {
+		return;
+	    }
+	    // start from rest, after whatever is still queued
+	    if (tstart + tick / FIRQ < now()) {
+		tstart = now();
+		tick = 0;
+		tlast = 0.0;
+	    }
+	    jmask = wmask;
+	    jcw = wcw;
+	    jsign = wsign;
+	    dirs(jcw ? 0x0f : 0x00);
+	    plan(0.0, 0);
+	}
+
+	v = speed_at_l(s, kleg * res);
+	if (kleg == nleg && stopping) {
+	    jmask = 0;
+	    continue;
+	} else if (kleg == nleg) {
+	    plan(v, 0);
+	} else if (!stopping && (wmask != jmask || wcw != jcw)) {
+	    if (v <= 0.0) {			// hasn't moved yet
+		jmask = 0;
+		continue;
+	    }
+	    plan(v, 1);
+	} else if (stopping && wmask == jmask && wcw == jcw) {
+	    plan(v, 0);
+	}
+	jstep();
+    }
+}
+
+// a key press or repeat for axis mask
+
+void key(int mask, int cw, int sign)
+{
+    if (mask == wmask && cw == wcw) {
+	repeats++;
+    } else {
+	repeats = 0;
+    }
+    wmask = mask;
+    wcw = cw;
+    wsign = sign;
+    tkey = now();
+}
+
+int main(int argc, char **argv)
+{
+    int i, k;
     char c;
-    int x,y,z;
-    int debug=0;
+    char kbuf[64];
     int cc;
+    int quit = 0;
+    int wait;
+    struct pollfd pfd;
     FILE *USBDEV;
 
+    extern int optind;
+    extern char *optarg;
+    int errflg = 0;
+
+    while ((cc = getopt(argc, argv, "a:b:d:p:r:v:")) != EOF) {
+	switch (cc) {
+	case 'a':			// set acceleration limit
+	    amax = atof(optarg);
+	    break;
+	case 'b':			// link baud rate
+	    baud = atoi(optarg);
+	    break;
+	case 'd':
+	    debug = atoi(optarg);
+	    break;
+	case 'p':			// serial device
+	    dev = optarg;
+	    break;
+	case 'r':			// set step size
+	    res = atof(optarg);
+	    break;
+	case 'v':			// set jog speed
+	    vmax = atof(optarg);
+	    break;
+	default:
+	    errflg = 1;
+	    break;
+	}
+    }
+
+    if (errflg || amax <= 0.0 || vmax <= 0.0 || res <= 0.0 || baud <= 0) {
+	fprintf(stderr, "usage: %s [options]\n", argv[0]);
+	fprintf(stderr, "     -a <amax>  ; jog acceleration (inches/second^2)\n");
+	fprintf(stderr, "     -b <baud>  ; link baud rate (default %d)\n", SERIAL_BAUD);
+	fprintf(stderr, "     -d <debug> ; verbose debugging\n");
+	fprintf(stderr, "     -p <dev>   ; serial device (default %s)\n", SERIAL_DEV);
+	fprintf(stderr, "     -r <res>   ; step size (inches)\n");
+	fprintf(stderr, "     -v <vmax>  ; jog speed (inches/second)\n");
+	exit(1);
+    }
+
     x=y=z=0;
 
-    USBDEV = init_drip(MODEM);
+    USBDEV = serial_open(dev, baud);
+    bc_output(USBDEV);
 
     if ((size_t) signal(SIGINT, sigcatch) < 0) {
 	perror("signal");
@@ -147,77 +328,112 @@ void main()
 	exit(1);
     }
 
-    fprintf(stderr, "cnc jog program: use backspace to quit\n\r");
+    fprintf(stderr, "cnc jog program: hold a key to jog, use backspace to quit\n\r");
     fprintf(stderr, "k, j, h, l, v, r\n\r");
 
     int state=0;
-    while ((i = read(0, &c, 1)) == 1) {
-	switch (state) {
-	   case 0:
-	      if (c == 27) {	// <ESC>
-	         state=1;
-	      } else {
-		 if (c == 'k') {
-		     y+=pulse(USBDEV, 0x8f, 0x92, count);
-		 } else if (c == 'j') {
-		     y-=pulse(USBDEV, 0x80, 0x92, count);
-		 } else if (c == 'h') {
-		     x-=pulse(USBDEV, 0x8f, 0x91, count);
-		 } else if (c == 'l') {
-		     x+=pulse(USBDEV, 0x80, 0x91, count);
-		 } else if (c == 'v') {
-		     z-=pulse(USBDEV, 0x80, 0x94, count);
-		 } else if (c == 'r') {
-		     z+=pulse(USBDEV, 0x8f, 0x94, count);
-		 } 
-	         state=0;
-	      }
-	      break;
-	   case 1:
-	      if (c == 91) {	// [
-	         state=2;
-	      } else {
-	         state = 0;
-	      }
-	      break;
-	   case 2:
+    tstart = now();
+    i = 1;
+    for (;;) {
+	jog();
+	fflush(USBDEV);
+	fprintf(stderr,"(x:%6d) (y:%6d) (z:%6d)\r", x, y, z);
+
+	if (quit && jmask == 0) {
+	    break;
+	}
+
+	// wake up in time to keep the queue topped up and to see
+	// a key release, otherwise sleep until a key comes in
+
+	wait = -1;
+	if (jmask) {
+	    wait = (int) (LEAD * 1000.0 / 3.0);
+	} else if (wmask) {
+	    wait = (int) (HOLD * 1000.0);
+	}
+	pfd.fd = 0;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, wait) > 0) {
+	    // take every byte waiting, so key repeats can't queue up
+	    if ((i = read(0, kbuf, sizeof(kbuf))) <= 0) {
+		break;
+	    }
+	    for (k = 0; k < i && !quit; k++) {
+		c = kbuf[k];
+		switch (state) {
+		   case 0:
+		      if (c == 27) {	// <ESC>
+			 state=1;
+		      } else {
+			 if (c == 'k') {
+			     key(YMASK, 1, 1);
+			 } else if (c == 'j') {
+			     key(YMASK, 0, -1);
+			 } else if (c == 'h') {
+			     key(XMASK, 1, -1);
+			 } else if (c == 'l') {
+			     key(XMASK, 0, 1);
+			 } else if (c == 'v') {
+			     key(ZMASK, 0, -1);
+			 } else if (c == 'r') {
+			     key(ZMASK, 1, 1);
+			 } 
+			 state=0;
+		      }
+		      break;
+		   case 1:
+		      if (c == 91) {	// [
+			 state=2;
+		      } else {
+			 state = 0;
+		      }
+		      break;
+		   case 2:
 
 // DIR     (7:0) '1000' wzyx  ; direction (0=ccw, 1=cw)
 // STEP    (7:0) '1001' wzyx  ; step (1=step, 0=idle)
 
-	      if (c == 53) {	// 5
-		 z+=pulse(USBDEV, 0x8f, 0x94, count);
-	         if (debug)  fprintf(stderr,"got pageup\n\r");
-	      } else if (c == 54) {	// 6
-		 z-=pulse(USBDEV, 0x80, 0x94, count);
-	         if (debug) fprintf(stderr,"got pagedown\n\r");
-	      } else if ((c &= 255) == 65) {	// A
-		 y+=pulse(USBDEV, 0x8f, 0x92, count);
-	         if (debug) fprintf(stderr,"got uparrow\n\r");
-	      } else if ((c &= 255) == 66) {	// B
-		 y-=pulse(USBDEV, 0x80, 0x92, count);
-	         if (debug) fprintf(stderr,"got downarrow\n\r");
-	      } else if ((c &= 255) == 67) {	// C
-		 x+=pulse(USBDEV, 0x80, 0x91, count);
-	         if (debug) fprintf(stderr,"got rightarrow\n\r");
-	      } else if ((c &= 255) == 68) {	// D
-		 x-=pulse(USBDEV, 0x8f, 0x91, count);
-	         if (debug) fprintf(stderr,"got leftarrow\n\r");
-	      }
-	      fflush(USBDEV);
-	      state=0;
-	      break;
-	    default:
-	      state=0;
-	      break;
+		      if (c == 53) {	// 5
+			 key(ZMASK, 1, 1);
+			 if (debug)  fprintf(stderr,"got pageup\n\r");
+		      } else if (c == 54) {	// 6
+			 key(ZMASK, 0, -1);
+			 if (debug) fprintf(stderr,"got pagedown\n\r");
+		      } else if ((c &= 255) == 65) {	// A
+			 key(YMASK, 1, 1);
+			 if (debug) fprintf(stderr,"got uparrow\n\r");
+		      } else if ((c &= 255) == 66) {	// B
+			 key(YMASK, 0, -1);
+			 if (debug) fprintf(stderr,"got downarrow\n\r");
+		      } else if ((c &= 255) == 67) {	// C
+			 key(XMASK, 0, 1);
+			 if (debug) fprintf(stderr,"got rightarrow\n\r");
+		      } else if ((c &= 255) == 68) {	// D
+			 key(XMASK, 1, -1);
+			 if (debug) fprintf(stderr,"got leftarrow\n\r");
+		      }
+		      state=0;
+		      break;
+		    default:
+		      state=0;
+		      break;
+		}
+		if ((c &= 255) == 0177)	/* ASCII DELETE */
+		    quit++;
+		if ((c & 255) == 'q')	/* quit */
+		    quit++;
+	    }
+	}
+
+	// no key repeat in time, the key was let go
+
+	if (quit || (wmask && now() - tkey > (repeats ? HOLD : HOLD1))) {
+	    wmask = 0;
 	}
-	if ((c &= 255) == 0177)	/* ASCII DELETE */
-	    break;
-	if ((c & 255) == 'q')	/* quit */
-	    break;
-	fprintf(stderr,"(x:%4d) (y:%4d) (z:%4d)\r", x, y, z);
-	fflush(stdout);
     }
+    fprintf(stderr,"\n");
+    serial_close(USBDEV);
 
     if (ttyreset(0) < 0) {
 	fprintf(stderr, "Cannot reset terminal!\n");
@@ -232,52 +448,6 @@ void main()
     exit(0);
 }
 
-FILE *pfd;
-int fd;
-struct termios oldtio, newtio;
-
-FILE *init_drip(char *tty) {
-
-    extern FILE *pfd;
-    extern int fd;
-    extern struct termios oldtio, newtio;
-
-    int d;
-
-    fd = open(tty, O_RDWR | O_NOCTTY | O_SYNC);
-    if (fd < 0) {
-        perror(tty);
-        exit(-1);
-    }
-
-    tcgetattr(fd, &oldtio);     /* save current settings */
-
-    bzero(&newtio, sizeof(newtio));
-    newtio.c_cflag = BAUD|CS8|CREAD|CRTSCTS;
-    newtio.c_iflag = IGNPAR;
-    newtio.c_oflag = 0;
-    newtio.c_lflag = 0; /* non-canonical, no echo, ... */
-
-    newtio.c_cc[VTIME]=TIMEOUT; /* inter-char timer decisecs */
-    newtio.c_cc[VMIN]=0;        /* block till n chars read */
-
-    tcflush(fd, TCIFLUSH);
-    tcsetattr(fd, TCSANOW, &newtio);
-
-    // must be opened "a+" instead of "r+" to avoid
-    // "illegal seek error"...
-
-    pfd = fdopen(fd, "a+");
-
-    if (pfd == NULL) {
-      printf("can't open %s!\n", tty);
-      exit (1);
-    }
-
-    fflush(pfd);
-    return(pfd);
-}
-
 /*
 27 91 53 126 pu	"<esc>[5~"
 27 91 54 126 pd	"<esc>[6~"
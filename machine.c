@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "corner.h"
+#include "machine.h"
+
+//
+// per-axis machine profile.  Each line of a profile file is
+//
+//	<axis> <vmax> <amax> <steps/inch> [<invert>]
+//
+// for axis x, y, z or w.  Blank lines and lines starting with '#'
+// are ignored, axes not mentioned keep the global -v, -a, -r values
+// and an axis without <invert> keeps its default direction.
+//
+//	# cnc3040
+//	x  0.30  1000  10160  1
+//	y  0.30  1000  10160  0
+//	z  0.10   200  10160  0
+//
+
+AXIS axis[NAXIS];
+
+// reset every axis to the global limits.  The cnc3040 x axis runs
+// backwards, so it is inverted by default.
+
+void machine_init(double vmax, double amax, double res)
+{
+    int k;
+
+    for (k = 0; k < NAXIS; k++) {
+	axis[k].name = "xyzw"[k];
+	axis[k].vmax = vmax;
+	axis[k].amax = amax;
+	axis[k].res = res;
+	axis[k].invert = 0;
+    }
+    axis[0].invert = 1;		// correct direction for cnc3040
+}
+
+int machine_load(char *file)
+{
+    FILE *fp;
+    char line[128];
+    char name;
+    double v, a, steps;
+    int inv, nf, k;
+    char *s;
+    int lineno = 0;
+    int errors = 0;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+	perror(file);
+	return (-1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	lineno++;
+	s = line + strspn(line, " \t\n");
+	if (*s == '\0' || *s == '#') {
+	    continue;
+	}
+	nf = sscanf(line, " %c %lf %lf %lf %d", &name, &v, &a, &steps, &inv);
+	for (k = 0; k < NAXIS; k++) {
+	    if (axis[k].name == name) break;
+	}
+	if (nf < 4 || k == NAXIS || v <= 0.0 || a <= 0.0 || steps <= 0.0) {
+	    fprintf(stderr, "%s: bad axis on line %d, \"%s\"\n",
+		file, lineno, line);
+	    errors++;
+	    continue;
+	}
+	axis[k].vmax = v;
+	axis[k].amax = a;
+	axis[k].res = 1.0 / steps;
+	if (nf == 5) {
+	    axis[k].invert = (inv != 0);
+	}
+    }
+    fclose(fp);
+    return (errors ? -1 : 0);
+}
+
+// lower the path velocity and acceleration limits *vlim, *alim for a
+// move along the unit direction u: each axis only sees its projection
+// of the path, so a segment is held back only by the axes it moves.
+
+void machine_limits(double *u, double *vlim, double *alim)
+{
+    int k;
+    double c;
+
+    for (k = 0; k < NAXIS; k++) {
+	c = fabs(u[k]);
+	if (c < 1.0e-12) {
+	    continue;
+	}
+	if (axis[k].vmax < *vlim * c) *vlim = axis[k].vmax / c;
+	if (axis[k].amax < *alim * c) *alim = axis[k].amax / c;
+    }
+}
+
+// finest step size of any axis
+
+double machine_res(void)
+{
+    int k;
+    double r = axis[0].res;
+
+    for (k = 1; k < NAXIS; k++) {
+	if (axis[k].res < r) r = axis[k].res;
+    }
+    return (r);
+}
@@ -0,0 +1,14 @@
+typedef struct axis {
+    char name;		// axis letter
+    double vmax;	// velocity limit (inches/second)
+    double amax;	// acceleration limit (inches/second^2)
+    double res;		// step size (inches/step)
+    int invert;		// 1 = reverse direction of travel
+} AXIS;
+
+extern AXIS axis[];		// x, y, z, w
+
+extern void machine_init(double vmax, double amax, double res);
+extern int machine_load(char *file);
+extern void machine_limits(double *u, double *vlim, double *alim);
+extern double machine_res(void);
@@ -0,0 +1,78 @@
+// stand-ins for the CCS PIC18 compiler built-ins, so servo4.c can be
+// built on the host and driven by sim.c.  CCS integers are unsigned
+// unless declared signed; the Makefile renames the declared ones to
+// sintN and uintN, and plain char is unsigned too (-funsigned-char).
+
+#define int1 unsigned char
+#define int8 unsigned char
+#define int16 unsigned short
+#define int32 unsigned int
+#define uint8 unsigned char
+#define uint16 unsigned short
+#define uint32 unsigned int
+#define sint8 signed char
+#define sint16 signed short
+#define sint32 signed int
+
+#define TRUE 1
+#define FALSE 0
+
+enum {
+    PIN_A0, PIN_A1, PIN_A2, PIN_A3, PIN_A4, PIN_A5,
+    PIN_B0, PIN_B1, PIN_B2, PIN_B3, PIN_B4,
+    PIN_C0, PIN_C1, PIN_C2, PIN_C3, PIN_C4, PIN_C5, PIN_C6, PIN_C7,
+    PIN_D0, PIN_D1, PIN_D2, PIN_D3, PIN_D4, PIN_D5, PIN_D6, PIN_D7,
+    PIN_E0, PIN_E1, PIN_E2
+};
+
+#define INT_RTCC 0
+#define INT_RDA 0
+#define GLOBAL 0
+#define CCP_PWM 0
+#define T0_INTERNAL 0
+#define T0_DIV_1 0
+#define T0_DIV_2 0
+#define T0_8_BIT 0
+#define T2_DIV_BY_16 0
+
+// provided by the simulator
+
+extern int usb_cdc_kbhit(void);
+extern char usb_cdc_getc(void);
+extern void output_d(unsigned char val);
+extern void usb_cdc_putc(char c);
+extern int usb_cdc_put_buffer_free(void);
+
+#define usb_task()
+#define usb_cdc_init()
+#define usb_init()
+#define usb_wait_for_enumeration()
+#define output_bit(pin, val)
+#define output_high(pin)
+#define output_low(pin)
+#define input(pin)
+#define delay_ms(ms)
+#define set_pwm1_duty(duty)
+#define setup_ccp1(mode)
+#define setup_timer_2(mode, period, post)
+#define set_timer2(val)
+#define setup_counters(src, div)
+#define set_timer0(val)
+#define enable_interrupts(irq)
+#define disable_interrupts(irq)
+
+// byte fifo, as in the firmware's queue.c
+
+#define QBUF 1024
+
+typedef struct queue {
+    unsigned char buf[QBUF];
+    int head, tail, n;
+} QUEUE;
+
+#define init_queue(q) ((q)->head = (q)->tail = (q)->n = 0)
+#define nqueue(q) ((q)->n)
+#define enqueue(q, c) ((q)->buf[(q)->head] = (c), \
+	(q)->head = ((q)->head + 1) % QBUF, (q)->n++)
+#define dequeue(q) ((q)->n--, (q)->tail = ((q)->tail + 1) % QBUF, \
+	(q)->buf[((q)->tail + QBUF - 1) % QBUF])
@@ -1,12 +1,16 @@
 // Servo drip feed
 // using 18F4550 built in full-speed USB and CCS CDC serial driver
 
+#ifdef __PCH__
 #include <18F4550.h>
 #device high_ints=true
 #priority int_rtcc, int_rda
 #fuses HS,NOWDT,NOPROTECT,NOLVP      // use x4 PLL
 #fuses PLL5,CPUDIV1,HSPLL,VREGEN
 #use delay(clock=48M, oscillator=20M)   // set clock to 40 MHz
+#else
+#include "hostpic.h"		// host build for sim.c
+#endif
 
 // uncomment to use bootloader
 // #include "bootloader.h"
@@ -14,7 +18,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#ifdef __PCH__
 #include <usb_cdc.h>
+#endif
 
 // fifo defines
 // FIXME: tuning
@@ -24,18 +30,76 @@
 #define LOBUF 200
 #define HIBUF 400
 
+#define LOOPMAX 512		// largest recordable loop body
+
+#ifdef __PCH__
 #include <queue.c>
+#endif
 
 QUEUE rxque0;	// incoming RS-232 byte-codes
-QUEUE txque0;	// outgoing stepper pulse bytes
+
+// outgoing tick queue: each entry is a port D byte and the number of
+// idle ticks to hold it for after it goes out, so a DELAY costs at
+// most one entry instead of one byte per tick.  At three bytes an
+// entry it takes the RAM the NBUF byte queue used to.
+
+#define NTICK (NBUF/3)
+
+unsigned int8 tqbyte[NTICK];
+unsigned int16 tqhold[NTICK];
+unsigned int8 tqhead=0;		// next entry to fill (main loop only)
+unsigned int8 tqtail=0;		// next entry to output (isr only)
+unsigned int16 tqleft=0;	// idle ticks left on the current entry
+unsigned int32 tqticks=0;	// ticks of motion queued, tqleft included
+
+unsigned int8 pbyte;	// entry still collecting delays, not queued
+unsigned int16 phold;
+int1 pend=0;
+
+// status frame, sent to the host every STATTICKS ticks:
+//   0xa5 0x5a, then little endian
+//   bytes received (4), rxque0 fill (2), tick queue entries (1),
+//   ticks queued (2), idle ticks (2), x y z w steps run (4 each)
+//   and the low byte of the sum of those 27 bytes
+
+#define STATTICKS 977	// 50 ms
+#define SYNC0 0xa5
+#define SYNC1 0x5a
+
+unsigned int32 rxcount=0;	// bytes taken from usb
+unsigned int16 idle=0;		// ticks with nothing to output
+signed int32 pos[4];		// steps run by the isr
+unsigned int16 stick=0;
+int1 sflag=0;			// time to send a frame
+unsigned int8 ssum;
+
+// s-code loop: a body is recorded while it executes and then
+// replayed from loopbuf without any further traffic from the host
+
+#define LIDLE 0		// not looping
+#define LREC  1		// recording a loop body
+#define LCNT1 2		// expecting high 7 bits of the repeat count
+#define LCNT2 3		// expecting low 7 bits of the repeat count
+#define LPLAY 4		// replaying the body
+
+unsigned int8 loopbuf[LOOPMAX];
+int16 looplen;		// length of the recorded body
+int16 looppos;		// replay position
+signed int16 loopcnt;	// replays left after this one, -1=forever
+int1 loopover;		// body didn't fit in loopbuf
+int8 lstate=LIDLE;
+
+unsigned int8 obyte=0;	// current dir/step output bits
 
 
 // #use fast_io(A)			// optimize output speed
 // #use fast_io(D)
 
+#ifdef __PCH__
 #use rs232(baud=230400, xmit=PIN_C6, rcv=PIN_C7, errors)
 
 #ZERO_RAM		// set all RAM to zero on startup
+#endif
 
 #define RTS	PIN_B0		// FTDI output low ready for input
 #define CTS	PIN_B1		// PIC output low ready for input
@@ -141,40 +205,253 @@ void set_step(int8 ss) { 	// set ms3,ms2,ms1
 // forward declarations
 void init();
 void blink();
+void status();
 
 void housekeep() {
+    if (sflag) {
+       sflag = 0;
+       status();
+    }
     usb_task(); 	// service periodic usb functions
     while (usb_cdc_kbhit() && (nqueue(&rxque0) < HIBUF)) {
 	enqueue(&rxque0, usb_cdc_getc());
+	rxcount++;
     }
 }
 
-void feed(char *c) {
-   while (nqueue(&txque0) >= NBUF-4) {
+unsigned int8 ntick() {
+   if (tqhead >= tqtail) {
+      return (tqhead - tqtail);
+   }
+   return (NTICK - tqtail + tqhead);
+}
+
+void feed(unsigned int8 c, unsigned int16 hold) {
+   while (ntick() >= NTICK-4) {
         output_bit(LED0,1);
 	housekeep(); 	// was a spin lock
    }
    output_bit(LED0,0);
-   enqueue(&txque0, c);
+   tqbyte[tqhead] = c;
+   tqhold[tqhead] = hold;
+   disable_interrupts(INT_RTCC);	// counted before the isr can take it
+   tqticks += 1 + hold;
+   enable_interrupts(INT_RTCC);
+   if (tqhead == NTICK-1) {
+      tqhead = 0;		// publish the entry last
+   } else {
+      tqhead++;
+   }
+}
+
+// queue the entry being built
+
+void flush() {
+   if (pend) {
+      feed(pbyte, phold);
+      pend = 0;
+   }
+}
+
+// a step starts a new entry, and the delays after it add to its hold
+
+void tick(unsigned int8 c) {
+   flush();
+   pbyte = c;
+   phold = 0;
+   pend = 1;
+}
+
+void hold(unsigned int8 d) {
+   if (d == 0) {
+      return;
+   }
+   if (!pend || phold > 0xffff-0x7f) {
+      tick(obyte&0x55);		// idle tick, dir bits only
+      d--;
+   }
+   phold += d;
 }
 
 // implements simple s-code interpreter
-// DELAY   (7:0) '0'nnn nnnn  ; delay n+1 counts
+// DELAY   (7:0) '0'nnn nnnn  ; idle n ticks
 // DIR     (7:0) '1000' wxyz  ; direction (0=ccw, 1=cw)
-// STEP    (7:0) '1001' wxyz  ; step (1=step, 0=idle)
+// STEP    (7:0) '1001' wxyz  ; step (1=step, 0=idle), 1 tick
 // MODE    (7:0) '1010' 0mmm  ; set ustep mode
 // STAT    (7:0) '1010' 1res  ; set reset, enable, sleep
+// LOOP    (7:0) '1011' 0000  ; start recording a loop body
+// ENDL    (7:0) '1011' 0001  ; end of body, then '0nnn nnnn' '0nnn nnnn'
+//                            ; give a 14 bit run count, 0=forever
 // ----    (7:0) '1011' ----  ; undefined
 // SPIN	   (7:0) '11'nn nnnn  ; duty cycle is n/64 0=off
 
+#define LOOP 0xb0
+#define ENDL 0xb1
 
-void main() {
+void exec(char c) {
     unsigned int8 d;	// delay value
-    unsigned int8 i;	
-    unsigned int8 obyte=0;
     int16 spin;		// pwm 0->1023
+
+    if ((c&0xf0) == 0x90) {              // step code
+       obyte &= 0x55;    // zero step bits
+       if (c&XMASK) { obyte|= 0x02; } 
+       if (c&YMASK) { obyte|= 0x08; } 
+       if (c&ZMASK) { obyte|= 0x20; } 
+       if (c&WMASK) { obyte|= 0x80; } 
+       tick(obyte);
+    } else if ((c&0x80)==0) {            // delay code
+       d = ((unsigned int8)c)&0x7f;
+       hold(d);                          // stall
+    } else if ((c&0xf0) == 0x80) {       // dir code
+       obyte &= 0xaa;    // zero dir bits
+       if (c&XMASK) { obyte|= 0x01; } 
+       if (c&YMASK) { obyte|= 0x04; } 
+       if (c&ZMASK) { obyte|= 0x10; } 
+       if (c&WMASK) { obyte|= 0x40; } 
+    } else if ((c&0xf0) == 0xa0) {       
+       if ((c&0x08)) {
+	   d = ((unsigned int8)c)&0x07;
+	   enable(d);                    // state
+       } else {
+	   d = ((unsigned int8)c)&0x07;
+	   set_step(d);                  // mode
+       }
+    } else if ((c&0xc0) == 0xc0) {       // spindle PWM speed    
+	spin=c&0x3f;     // get the bits 
+	spin = spin<<4;
+	set_pwm1_duty(spin);     // duty cycle is val/(4*(255+1))
+    } else {
+       ; // unknown code, silently ignore
+    }
+}
+
+// the first pass of a loop body runs as it is recorded, the count
+// says how many passes to run in all.  A forever loop stops at the
+// end of a pass as soon as the host sends anything new.
+
+void loop(char c) {
+    switch (lstate) {
+    case LREC:
+	if ((unsigned int8)c == ENDL) {
+	    lstate = LCNT1;
+	} else {
+	    if (looplen < LOOPMAX) {
+		loopbuf[looplen++] = c;
+	    } else {
+		loopover = 1;
+	    }
+	    exec(c);
+	}
+	break;
+    case LCNT1:
+	loopcnt = ((int16)(c&0x7f))<<7;
+	lstate = LCNT2;
+	break;
+    case LCNT2:
+	loopcnt |= (c&0x7f);
+	loopcnt--;			// first pass already ran
+	looppos = 0;
+	lstate = LPLAY;
+	if (loopover || looplen == 0 || loopcnt == 0) {
+	    output_bit(LED1, loopover);	// flag a dropped loop
+	    lstate = LIDLE;
+	}
+	break;
+    }
+}
+
+void sput(unsigned int8 c) {
+    usb_cdc_putc(c);
+    ssum += c;
+}
+
+void sput16(unsigned int16 v) {
+    sput(v); sput(v>>8);
+}
+
+void sput32(unsigned int32 v) {
+    sput(v); sput(v>>8); sput(v>>16); sput(v>>24);
+}
+
+// skipped when the host isn't reading, a stale frame is no use
+
+void status() {
+    signed int32 p[4];
+    unsigned int32 t;
+    unsigned int8 i, n;
+    unsigned int16 dry;
+
+    if (usb_cdc_put_buffer_free() < 30) {
+       return;
+    }
+
+    disable_interrupts(INT_RTCC);	// a consistent snapshot, kept short
+    for (i=0; i<4; i++) {
+       p[i] = pos[i];
+    }
+    t = tqticks;
+    n = ntick();
+    dry = idle;
+    enable_interrupts(INT_RTCC);
+    if (t > 0xffff) {
+       t = 0xffff;
+    }
+
+    usb_cdc_putc(SYNC0);
+    usb_cdc_putc(SYNC1);
+    ssum = 0;
+    sput32(rxcount);
+    sput16(nqueue(&rxque0));
+    sput(n);
+    sput16(t);
+    sput16(dry);
+    for (i=0; i<4; i++) {
+       sput32(p[i]);
+    }
+    usb_cdc_putc(ssum);
+}
+
+// one pass of the main loop
+
+void service() {
     char c;
 
+    // get chars from usb
+    housekeep();
+
+    // replay a recorded loop body
+    if (lstate == LPLAY) {
+       exec(loopbuf[looppos++]);
+       if (looppos >= looplen) {
+	  looppos = 0;
+	  if (loopcnt > 0) loopcnt--;
+	  if (loopcnt == 0 || (loopcnt < 0 && nqueue(&rxque0) > 0)) {
+	     lstate = LIDLE;
+	  }
+       }
+       return;
+    }
+
+    // now process the input and feed output queue
+    if (nqueue(&rxque0) > 0) {
+       c = dequeue(&rxque0);
+       if (lstate != LIDLE) {
+	  loop(c);
+       } else if ((unsigned int8)c == LOOP) {
+	  looplen = 0;
+	  loopover = 0;
+	  lstate = LREC;
+       } else {
+	  exec(c);
+       }
+    } else {
+       flush();		// nothing more to merge for now
+    }
+}
+
+#ifdef __PCH__
+void main() {
+
     // port D (7:0) SW,DW SZ,DZ SY,DY SX,DX
 
     init();
@@ -184,59 +461,41 @@ void main() {
     usb_wait_for_enumeration();
 
     while (TRUE) {
-
-	// get chars from usb
-	housekeep();
-
-	// now process the input and feed output queue
-        if (nqueue(&rxque0) > 0) {
-	   c = dequeue(&rxque0);
-	   if ((c&0xf0) == 0x90) {		// step code
-              obyte &= 0x55;	// zero step bits
-	      if (c&XMASK) { obyte|= 0x02; } 
-	      if (c&YMASK) { obyte|= 0x08; } 
-	      if (c&ZMASK) { obyte|= 0x20; } 
-	      if (c&WMASK) { obyte|= 0x80; } 
-	      feed(obyte);
-	   } else if ((c&0x80)==0) {	 	// delay code
-	      d = ((unsigned int8)c)&0x7f;
-	      for (i=1; i<=d; i++) {
-	         feed(0x00);	// stall
-	      }
-	   } else if ((c&0xf0) == 0x80) {	// dir code
-              obyte &= 0xaa;	// zero dir bits
-	      if (c&XMASK) { obyte|= 0x01; } 
-	      if (c&YMASK) { obyte|= 0x04; } 
-	      if (c&ZMASK) { obyte|= 0x10; } 
-	      if (c&WMASK) { obyte|= 0x40; } 
-	   } else if ((c&0xf0) == 0xa0) {	
-	      if ((c&0x08)) {
-		  d = ((unsigned int8)c)&0x07;
-		  enable(d);			// state
-	      } else {
-		  d = ((unsigned int8)c)&0x07;
-		  set_step(d);			// mode
-	      }
-	   } else if ((c&0xc0) == 0xc0) {	// spindle PWM speed	
-	       spin=c&0x3f;	// get the bits 
-	       spin = spin<<4;
-	       set_pwm1_duty(spin);	// duty cycle is val/(4*(255+1))
-	   } else {
-	      ; // unknown code, silently ignore
-	   }
-        } 
+	service();
     }
 }
 
 #int_rtcc  high
+#endif
 void irq_rtcc_hi()
 {
     int8 val;
     
-    if (nqueue(&txque0) > 0) {
-       val=dequeue(&txque0);
+    if (++stick >= STATTICKS) {
+       stick = 0;
+       sflag = 1;
+    }
+
+    if (tqleft > 0) {
+       tqleft--;			// hold the last output
+       tqticks--;
+    } else if (tqtail != tqhead) {
+       tqticks--;
+       val=tqbyte[tqtail];
+       tqleft=tqhold[tqtail];
+       if (tqtail == NTICK-1) {
+	  tqtail = 0;
+       } else {
+	  tqtail++;
+       }
        output_d(val);			// output
        output_d(val&0x55);		// mask step (force low)
+       if (val&0x02) { pos[0] += (val&0x01) ? 1 : -1; }
+       if (val&0x08) { pos[1] += (val&0x04) ? 1 : -1; }
+       if (val&0x20) { pos[2] += (val&0x10) ? 1 : -1; }
+       if (val&0x80) { pos[3] += (val&0x40) ? 1 : -1; }
+    } else {
+       idle++;
     }
 }
 
@@ -263,7 +522,6 @@ void init() {
    blink();
 
    init_queue(&rxque0);
-   init_queue(&txque0);
 
    set_step(1);		// 0=full, 1=1/2, 5=1/4, 4=1/8, 7=1/16
    enable(1);
@@ -0,0 +1,554 @@
+// Servo drip feed
+// using 18F4550 built in full-speed USB and CCS CDC serial driver
+
+#ifdef __PCH__
+#include <18F4550.h>
+#device high_ints=true
+#priority int_rtcc, int_rda
+#fuses HS,NOWDT,NOPROTECT,NOLVP      // use x4 PLL
+#fuses PLL5,CPUDIV1,HSPLL,VREGEN
+#use delay(clock=48M, oscillator=20M)   // set clock to 40 MHz
+#else
+#include "hostpic.h"		// host build for sim.c
+#endif
+
+// uncomment to use bootloader
+// #include "bootloader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef __PCH__
+#include <usb_cdc.h>
+#endif
+
+// fifo defines
+// FIXME: tuning
+// size of txque0 should be bigger than rxque0
+
+#define NBUF  600
+#define LOBUF 200
+#define HIBUF 400
+
+#define LOOPMAX 512		// largest recordable loop body
+
+#ifdef __PCH__
+#include <queue.c>
+#endif
+
+QUEUE rxque0;	// incoming RS-232 byte-codes
+
+// outgoing tick queue: each entry is a port D byte and the number of
+// idle ticks to hold it for after it goes out, so a DELAY costs at
+// most one entry instead of one byte per tick.  At three bytes an
+// entry it takes the RAM the NBUF byte queue used to.
+
+#define NTICK (NBUF/3)
+
+uint8 tqbyte[NTICK];
+uint16 tqhold[NTICK];
+uint8 tqhead=0;		// next entry to fill (main loop only)
+uint8 tqtail=0;		// next entry to output (isr only)
+uint16 tqleft=0;	// idle ticks left on the current entry
+uint32 tqticks=0;	// ticks of motion queued, tqleft included
+
+uint8 pbyte;	// entry still collecting delays, not queued
+uint16 phold;
+int1 pend=0;
+
+// status frame, sent to the host every STATTICKS ticks:
+//   0xa5 0x5a, then little endian
+//   bytes received (4), rxque0 fill (2), tick queue entries (1),
+//   ticks queued (2), idle ticks (2), x y z w steps run (4 each)
+//   and the low byte of the sum of those 27 bytes
+
+#define STATTICKS 977	// 50 ms
+#define SYNC0 0xa5
+#define SYNC1 0x5a
+
+uint32 rxcount=0;	// bytes taken from usb
+uint16 idle=0;		// ticks with nothing to output
+sint32 pos[4];		// steps run by the isr
+uint16 stick=0;
+int1 sflag=0;			// time to send a frame
+uint8 ssum;
+
+// s-code loop: a body is recorded while it executes and then
+// replayed from loopbuf without any further traffic from the host
+
+#define LIDLE 0		// not looping
+#define LREC  1		// recording a loop body
+#define LCNT1 2		// expecting high 7 bits of the repeat count
+#define LCNT2 3		// expecting low 7 bits of the repeat count
+#define LPLAY 4		// replaying the body
+
+uint8 loopbuf[LOOPMAX];
+int16 looplen;		// length of the recorded body
+int16 looppos;		// replay position
+sint16 loopcnt;	// replays left after this one, -1=forever
+int1 loopover;		// body didn't fit in loopbuf
+int8 lstate=LIDLE;
+
+uint8 obyte=0;	// current dir/step output bits
+
+
+// #use fast_io(A)			// optimize output speed
+// #use fast_io(D)
+
+#ifdef __PCH__
+#use rs232(baud=230400, xmit=PIN_C6, rcv=PIN_C7, errors)
+
+#ZERO_RAM		// set all RAM to zero on startup
+#endif
+
+#define RTS	PIN_B0		// FTDI output low ready for input
+#define CTS	PIN_B1		// PIC output low ready for input
+#define STROBE  PIN_A1		// parallel port strobe
+
+#define XMASK 	0x01
+#define YMASK 	0x02
+#define ZMASK 	0x04
+#define WMASK 	0x08
+
+#define LED0     PIN_C0		 // status LEDs
+#define LED1     PIN_C1
+#define LED2     PIN_C2 	 // now PWM output
+
+// #define CONN1	+5
+// #define CONN2 	+5
+// #define CONN4	+5
+// #define CONN29	GND
+// #define CONN31	GND
+// #define CONN32	GND
+
+#define CONN21	 PIN_A0		//	ena
+#define CONN22	 PIN_A1		// 	rst
+#define CONN19	 PIN_A2		// 	ms1
+#define CONN20	 PIN_A3		// 	ms2
+#define CONN17	 PIN_A4		//	ms3
+#define CONN18	 PIN_A5
+#define CONN25	 PIN_B2		// 	sleep
+#define CONN28	 PIN_B3
+#define CONN27	 PIN_B4
+
+#define CONN14	 PIN_C0
+#define CONN11	 PIN_C1		
+// #define CONN9	 PIN_C3
+#define CONN6	 PIN_C4
+#define CONN3	 PIN_C5
+
+
+// fixme: rev 2 should be dir 3210, step 3210 
+// instead of interleaved to improve processing speed
+
+#define CONN10	 PIN_D0		//	dir0
+#define CONN7	 PIN_D1		//	stp0
+#define CONN8	 PIN_D2		//	dir1
+#define CONN5	 PIN_D3		//	stp1
+#define CONN30	 PIN_D4		//	dir2
+#define CONN24	 PIN_D5		//	stp2
+#define CONN23	 PIN_D6		//	dir3
+#define CONN26	 PIN_D7		//	stp3
+
+#define CONN12	 PIN_C2		// CCP1 PWM output to spindle
+
+#define CONN15	 PIN_E0
+#define CONN16	 PIN_E1
+#define CONN13	 PIN_E2
+
+// MS3 MS2 MS1
+// L   L   L	// full step
+// L   L   H	// half step
+// L   H   L	// quarter step
+// L   H   H	// eighth step
+// H   H   H	// sixteenth
+// ---------------
+// STEP
+// L->H advances motor
+// 200 ns minimum setup/hold on DIR/MS/RST
+// 1uS minimum pulse width
+// ---------------
+// DIR
+// L	CW
+// H	CCW
+// ---------------
+// RESET
+// H 	NORMAL MODE
+// L    RESET - all outputs off
+// ---------------
+// ENABLE
+// H	all outputs off
+// L    normal operation
+// ---------------
+// port D (7:0) S3,D3 S2,D2 S1,D1 S0,D0
+// port A (7:0) X,X,MS3,MS2,MS1,RST,ENA
+
+void enable(int8 ss) { 		// enable if ss != 0	
+    output_bit(PIN_B2, ss);	// sleep (active low)
+    output_bit(PIN_A0, !ss);	// enable (active low)
+    output_bit(PIN_A1, ss);	// reset active high
+}
+
+// MS3 MS2 MS1
+// L   L   L	// full step
+// L   L   H	// half step
+// L   H   L	// quarter step
+// L   H   H	// eighth step
+// H   H   H	// sixteenth
+
+void set_step(int8 ss) { 	// set ms3,ms2,ms1
+    output_bit(PIN_A4, ss&4);
+    output_bit(PIN_A3, ss&2);
+    output_bit(PIN_A2, ss&1);
+}
+
+// forward declarations
+void init();
+void blink();
+void status();
+
+void housekeep() {
+    if (sflag) {
+       sflag = 0;
+       status();
+    }
+    usb_task(); 	// service periodic usb functions
+    while (usb_cdc_kbhit() && (nqueue(&rxque0) < HIBUF)) {
+	enqueue(&rxque0, usb_cdc_getc());
+	rxcount++;
+    }
+}
+
+uint8 ntick() {
+   if (tqhead >= tqtail) {
+      return (tqhead - tqtail);
+   }
+   return (NTICK - tqtail + tqhead);
+}
+
+void feed(uint8 c, uint16 hold) {
+   while (ntick() >= NTICK-4) {
+        output_bit(LED0,1);
+	housekeep(); 	// was a spin lock
+   }
+   output_bit(LED0,0);
+   tqbyte[tqhead] = c;
+   tqhold[tqhead] = hold;
+   disable_interrupts(INT_RTCC);	// counted before the isr can take it
+   tqticks += 1 + hold;
+   enable_interrupts(INT_RTCC);
+   if (tqhead == NTICK-1) {
+      tqhead = 0;		// publish the entry last
+   } else {
+      tqhead++;
+   }
+}
+
+// queue the entry being built
+
+void flush() {
+   if (pend) {
+      feed(pbyte, phold);
+      pend = 0;
+   }
+}
+
+// a step starts a new entry, and the delays after it add to its hold
+
+void tick(uint8 c) {
+   flush();
+   pbyte = c;
+   phold = 0;
+   pend = 1;
+}
+
+void hold(uint8 d) {
+   if (d == 0) {
+      return;
+   }
+   if (!pend || phold > 0xffff-0x7f) {
+      tick(obyte&0x55);		// idle tick, dir bits only
+      d--;
+   }
+   phold += d;
+}
+
+// implements simple s-code interpreter
+// DELAY   (7:0) '0'nnn nnnn  ; idle n ticks
+// DIR     (7:0) '1000' wxyz  ; direction (0=ccw, 1=cw)
+// STEP    (7:0) '1001' wxyz  ; step (1=step, 0=idle), 1 tick
+// MODE    (7:0) '1010' 0mmm  ; set ustep mode
+// STAT    (7:0) '1010' 1res  ; set reset, enable, sleep
+// LOOP    (7:0) '1011' 0000  ; start recording a loop body
+// ENDL    (7:0) '1011' 0001  ; end of body, then '0nnn nnnn' '0nnn nnnn'
+//                            ; give a 14 bit run count, 0=forever
+// ----    (7:0) '1011' ----  ; undefined
+// SPIN	   (7:0) '11'nn nnnn  ; duty cycle is n/64 0=off
+
+#define LOOP 0xb0
+#define ENDL 0xb1
+
+void exec(char c) {
+    uint8 d;	// delay value
+    int16 spin;		// pwm 0->1023
+
+    if ((c&0xf0) == 0x90) {              // step code
+       obyte &= 0x55;    // zero step bits
+       if (c&XMASK) { obyte|= 0x02; } 
+       if (c&YMASK) { obyte|= 0x08; } 
+       if (c&ZMASK) { obyte|= 0x20; } 
+       if (c&WMASK) { obyte|= 0x80; } 
+       tick(obyte);
+    } else if ((c&0x80)==0) {            // delay code
+       d = ((uint8)c)&0x7f;
+       hold(d);                          // stall
+    } else if ((c&0xf0) == 0x80) {       // dir code
+       obyte &= 0xaa;    // zero dir bits
+       if (c&XMASK) { obyte|= 0x01; } 
+       if (c&YMASK) { obyte|= 0x04; } 
+       if (c&ZMASK) { obyte|= 0x10; } 
+       if (c&WMASK) { obyte|= 0x40; } 
+    } else if ((c&0xf0) == 0xa0) {       
+       if ((c&0x08)) {
+	   d = ((uint8)c)&0x07;
+	   enable(d);                    // state
+       } else {
+	   d = ((uint8)c)&0x07;
+	   set_step(d);                  // mode
+       }
+    } else if ((c&0xc0) == 0xc0) {       // spindle PWM speed    
+	spin=c&0x3f;     // get the bits 
+	spin = spin<<4;
+	set_pwm1_duty(spin);     // duty cycle is val/(4*(255+1))
+    } else {
+       ; // unknown code, silently ignore
+    }
+}
+
+// the first pass of a loop body runs as it is recorded, the count
+// says how many passes to run in all.  A forever loop stops at the
+// end of a pass as soon as the host sends anything new.
+
+void loop(char c) {
+    switch (lstate) {
+    case LREC:
+	if ((uint8)c == ENDL) {
+	    lstate = LCNT1;
+	} else {
+	    if (looplen < LOOPMAX) {
+		loopbuf[looplen++] = c;
+	    } else {
+		loopover = 1;
+	    }
+	    exec(c);
+	}
+	break;
+    case LCNT1:
+	loopcnt = ((int16)(c&0x7f))<<7;
+	lstate = LCNT2;
+	break;
+    case LCNT2:
+	loopcnt |= (c&0x7f);
+	loopcnt--;			// first pass already ran
+	looppos = 0;
+	lstate = LPLAY;
+	if (loopover || looplen == 0 || loopcnt == 0) {
+	    output_bit(LED1, loopover);	// flag a dropped loop
+	    lstate = LIDLE;
+	}
+	break;
+    }
+}
+
+void sput(uint8 c) {
+    usb_cdc_putc(c);
+    ssum += c;
+}
+
+void sput16(uint16 v) {
+    sput(v); sput(v>>8);
+}
+
+void sput32(uint32 v) {
+    sput(v); sput(v>>8); sput(v>>16); sput(v>>24);
+}
+
+// skipped when the host isn't reading, a stale frame is no use
+
+void status() {
+    sint32 p[4];
+    uint32 t;
+    uint8 i, n;
+    uint16 dry;
+
+    if (usb_cdc_put_buffer_free() < 30) {
+       return;
+    }
+
+    disable_interrupts(INT_RTCC);	// a consistent snapshot, kept short
+    for (i=0; i<4; i++) {
+       p[i] = pos[i];
+    }
+    t = tqticks;
+    n = ntick();
+    dry = idle;
+    enable_interrupts(INT_RTCC);
+    if (t > 0xffff) {
+       t = 0xffff;
+    }
+
+    usb_cdc_putc(SYNC0);
+    usb_cdc_putc(SYNC1);
+    ssum = 0;
+    sput32(rxcount);
+    sput16(nqueue(&rxque0));
+    sput(n);
+    sput16(t);
+    sput16(dry);
+    for (i=0; i<4; i++) {
+       sput32(p[i]);
+    }
+    usb_cdc_putc(ssum);
+}
+
+// one pass of the main loop
+
+void service() {
+    char c;
+
+    // get chars from usb
+    housekeep();
+
+    // replay a recorded loop body
+    if (lstate == LPLAY) {
+       exec(loopbuf[looppos++]);
+       if (looppos >= looplen) {
+	  looppos = 0;
+	  if (loopcnt > 0) loopcnt--;
+	  if (loopcnt == 0 || (loopcnt < 0 && nqueue(&rxque0) > 0)) {
+	     lstate = LIDLE;
+	  }
+       }
+       return;
+    }
+
+    // now process the input and feed output queue
+    if (nqueue(&rxque0) > 0) {
+       c = dequeue(&rxque0);
+       if (lstate != LIDLE) {
+	  loop(c);
+       } else if ((uint8)c == LOOP) {
+	  looplen = 0;
+	  loopover = 0;
+	  lstate = LREC;
+       } else {
+	  exec(c);
+       }
+    } else {
+       flush();		// nothing more to merge for now
+    }
+}
+
+#ifdef __PCH__
+void main() {
+
+    // port D (7:0) SW,DW SZ,DZ SY,DY SX,DX
+
+    init();
+
+    usb_cdc_init();
+    usb_init();
+    usb_wait_for_enumeration();
+
+    while (TRUE) {
+	service();
+    }
+}
+
+#int_rtcc  high
+#endif
+void irq_rtcc_hi()
+{
+    int8 val;
+    
+    if (++stick >= STATTICKS) {
+       stick = 0;
+       sflag = 1;
+    }
+
+    if (tqleft > 0) {
+       tqleft--;			// hold the last output
+       tqticks--;
+    } else if (tqtail != tqhead) {
+       tqticks--;
+       val=tqbyte[tqtail];
+       tqleft=tqhold[tqtail];
+       if (tqtail == NTICK-1) {
+	  tqtail = 0;
+       } else {
+	  tqtail++;
+       }
+       output_d(val);			// output
+       output_d(val&0x55);		// mask step (force low)
+       if (val&0x02) { pos[0] += (val&0x01) ? 1 : -1; }
+       if (val&0x08) { pos[1] += (val&0x04) ? 1 : -1; }
+       if (val&0x20) { pos[2] += (val&0x10) ? 1 : -1; }
+       if (val&0x80) { pos[3] += (val&0x40) ? 1 : -1; }
+    } else {
+       idle++;
+    }
+}
+
+void blink() {
+    int i;
+    for (i=0; i<4; i++) {
+    	output_high(LED0); output_high(LED1);
+    	delay_ms(125);
+    	output_low(LED0); output_low(LED1);
+    	delay_ms(125);
+    }
+}
+
+// INTS_PER_SECOND  2441	// (40e6/(4*16*256)) // div by 16
+// INTS_PER_SECOND  9766	// (40e6/(4*4*256))  // div by 4
+// INTS_PER_SECOND 19531	// (40e6/(4*2*256))  // div by 2
+//
+// INTS_PER_SECOND 23437	// (48e6/(4*2*256))  // div by 2
+// INTS_PER_SECOND 46875	// (48e6/(4*1*256))  // div by 1
+
+void init() {
+   uint16 i;
+
+   blink();
+
+   init_queue(&rxque0);
+
+   set_step(1);		// 0=full, 1=1/2, 5=1/4, 4=1/8, 7=1/16
+   enable(1);
+
+   //setup_counters(T0_INTERNAL, T0_DIV_1 | T0_8_BIT);
+   setup_counters(T0_INTERNAL, T0_DIV_2 | T0_8_BIT);
+
+   set_timer0(0);
+
+   enable_interrupts(INT_RTCC);
+   enable_interrupts(INT_RDA);
+   enable_interrupts(GLOBAL);
+
+   output_bit(CTS,0);		// ready to receive from usb
+   output_bit(STROBE,1);	// parallel port strobe
+
+   // input(PIN_C3);		// ESTOP
+   input(PIN_C4);		// ALIM
+   input(PIN_C0);		// XLIM
+   input(PIN_C1);		// YLIM
+   
+   // input(PIN_C2);		// ZLIM
+   output_bit(PIN_C2,0);	// changed from ZLIM to PWM OUTPUT
+
+   setup_ccp1(CCP_PWM);
+   setup_timer_2(T2_DIV_BY_16, 255, 1); // mode, period, postscale
+   set_timer2(0);
+   set_pwm1_duty(0);		// duty cycle is val/(4*(255+1))
+}
+		
@@ -0,0 +1,320 @@
+#define _GNU_SOURCE		// pseudo ttys
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <termios.h>
+
+#include "servo4host.c"		// servo4.c, see the Makefile
+
+//
+// tick simulator for servo4.c, built on the host with hostpic.h.
+// Byte codes from stdin arrive over a link of -b baud into the
+// firmware's receive queue, the main loop gets -c passes per timer
+// tick and the tick ISR runs the output queue.  Alongside it runs a
+// model of the old firmware, which expanded every DELAY into idle
+// bytes in an NBUF byte queue, fed by a link of its own.  Reported for
+// both: how many ticks of motion the queue held whenever it was full,
+// and how many ticks it ran dry before the job was done.
+//
+// With -t the simulator stands in for the device instead: it prints
+// the name of a pseudo tty for feed -p, runs in real time on what
+// arrives there and sends the firmware's status frames back.
+//
+
+#define FIRQ 19531.0
+#define USBBUF 64		// bytes the usb endpoint holds
+#define TTYBUF 4096		// bytes read ahead from the pseudo tty
+
+unsigned char *in;		// byte codes
+long size = 1 << 16;
+long nin = 0;
+long pin = 0;			// next byte the link sends
+long prd = 0;			// next byte the firmware reads
+long steps = 0;
+unsigned char port = 0;
+
+int master = -1;		// pseudo tty, -t
+unsigned char out[USBBUF];	// status bytes to send back
+int nout = 0;
+long nframe = 0;
+
+double baud = 230400.0;
+int passes = 8;
+double linger = 1.0;		// -t: seconds idle before the job is over
+long tk = 0;			// ticks run
+double credit = 0.0;
+int started = 0;
+long dry = 0;			// ticks the new queue ran dry
+long nfull = 0, minfull = -1;
+double sumfull = 0.0;
+
+long opin = 0, ord = 0;		// old firmware model
+long oq = 0;			// idle/step bytes queued
+long orem = 0;			// bytes of the current code still to queue
+long ostep = 0;			// steps out
+long odry = 0;
+int ostarted = 0;
+int oskip = 0;
+double ocredit = 0.0;
+
+int usb_cdc_kbhit()
+{
+    return (prd < pin);
+}
+
+char usb_cdc_getc()
+{
+    return (in[prd++]);
+}
+
+int usb_cdc_put_buffer_free()
+{
+    return ((master >= 0) ? sizeof(out) - nout : sizeof(out));
+}
+
+void usb_cdc_putc(char c)
+{
+    if (master >= 0) {
+	out[nout++] = c;
+    }
+    if ((unsigned char) c == SYNC0) {
+	nframe++;
+    }
+}
+
+void output_d(unsigned char val)
+{
+    unsigned char up = val & ~port & 0xaa;
+
+    for (; up != 0; up &= up - 1) {
+	steps++;
+    }
+    port = val;
+}
+
+double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec + t.tv_nsec * 1e-9);
+}
+
+// ticks of motion in the new queue
+
+long queued()
+{
+    long t = tqleft;
+    int i;
+
+    for (i = tqtail; i != tqhead; i = (i + 1) % NTICK) {
+	t += 1 + tqhold[i];
+    }
+    return (t);
+}
+
+int done()
+{
+    return (prd == nin && nqueue(&rxque0) == 0 && !pend &&
+	lstate != LPLAY && tqtail == tqhead && tqleft == 0);
+}
+
+// new firmware: link, main loop, tick isr
+
+void newtick()
+{
+    long t;
+    int k;
+
+    credit += baud / 10.0 / FIRQ;
+    for (; credit >= 1.0 && pin < nin && pin - prd < USBBUF; credit -= 1.0) {
+	pin++;
+    }
+    if (credit > 1.0) {
+	credit = 1.0;		// flow controlled
+    }
+    for (k = 0; k < passes && ntick() < NTICK-4; k++) {
+	service();
+    }
+    if (ntick() >= NTICK-4 && (tk & 15) == 0) {
+	t = queued();
+	if (minfull < 0 || t < minfull) {
+	    minfull = t;
+	}
+	sumfull += t;
+	nfull++;
+    }
+    if (tqleft == 0 && tqtail == tqhead && started && !done()) {
+	dry++;
+    }
+    irq_rtcc_hi();
+    started |= (steps > 0);
+}
+
+// old firmware: one byte in the queue per tick
+
+void oldtick()
+{
+    unsigned char oc;
+    int k;
+
+    ocredit += baud / 10.0 / FIRQ;
+    for (; ocredit >= 1.0 && opin < nin && opin - ord < USBBUF + HIBUF; ocredit -= 1.0) {
+	opin++;
+    }
+    if (ocredit > 1.0) {
+	ocredit = 1.0;
+    }
+    for (k = 0; k < passes; k++) {
+	if (orem == 0 && ord < opin) {
+	    oc = in[ord++];
+	    if (oskip > 0) {
+		oskip--;
+	    } else if ((oc & 0x80) == 0) {
+		orem = oc;
+	    } else if ((oc & 0xf0) == 0x90) {
+		orem = 1;
+		ostep = 1;
+	    } else if (oc == ENDL) {
+		oskip = 2;		// loop replay isn't modelled
+	    }
+	}
+	for (; orem > 0 && oq < NBUF-3; orem--) {
+	    oq++;
+	}
+    }
+    if (oq > 0) {
+	oq--;
+	ostarted |= ostep;
+    } else if (ostarted && (ord < nin || orem > 0)) {
+	odry++;
+    }
+}
+
+// run in real time on a pseudo tty until the job has been done for
+// linger seconds with nothing new coming in
+
+void tty()
+{
+    struct termios tio;
+    double t0, tdone = 0.0;
+    int slave, k;
+
+    if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+	grantpt(master) < 0 || unlockpt(master) < 0) {
+	fprintf(stderr, "can't open a pseudo tty\n");
+	exit(1);
+    }
+
+    // hold the slave open so the link survives feed coming and going
+
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    printf("%s\n", ptsname(master));
+    fflush(stdout);
+
+    t0 = now();
+    for (;;) {
+	if (nin - pin < TTYBUF) {
+	    if (nin + TTYBUF > size) {
+		in = (unsigned char *) realloc(in, size *= 2);
+	    }
+	    if ((k = read(master, in + nin, TTYBUF - (nin - pin))) > 0) {
+		nin += k;
+	    }
+	}
+	while (tk < (now() - t0) * FIRQ) {
+	    tk++;
+	    newtick();
+	}
+	if (nout > 0 && (k = write(master, out, nout)) > 0) {
+	    memmove(out, out + k, nout - k);
+	    nout -= k;
+	}
+	if (nin == 0 || !done()) {
+	    tdone = now();
+	} else if (now() - tdone > linger) {
+	    break;
+	}
+	usleep(1000);
+    }
+    close(slave);
+    close(master);
+}
+
+int main(int argc, char **argv)
+{
+    extern int optind;
+    extern char *optarg;
+    int errflg = 0;
+    int c, k;
+    int live = 0;
+
+    while ((c = getopt(argc, argv, "b:c:tw:")) != EOF) {
+	switch (c) {
+	case 'b':			// link baud rate
+	    baud = atof(optarg);
+	    break;
+	case 'c':			// main loop passes per tick
+	    passes = atoi(optarg);
+	    break;
+	case 't':			// be the device on a pseudo tty
+	    live = 1;
+	    break;
+	case 'w':			// idle time that ends a -t job
+	    linger = atof(optarg);
+	    break;
+	default:
+	    errflg = 1;
+	    break;
+	}
+    }
+    if (errflg || optind != argc) {
+	fprintf(stderr, "usage: %s [options] < bytecodes\n", argv[0]);
+	fprintf(stderr, "     -b <baud>  ; link speed (default 230400)\n");
+	fprintf(stderr, "     -c <n>     ; main loop passes per tick (default 8)\n");
+	fprintf(stderr, "     -t         ; run as a device on a pseudo tty\n");
+	fprintf(stderr, "     -w <s>     ; with -t, end after s seconds idle (default 1)\n");
+	exit(1);
+    }
+
+    in = (unsigned char *) malloc(size);
+    init();
+
+    if (live) {
+	tty();
+	printf("job %ld bytes, %ld steps, %ld status frames, dry %ld ticks\n",
+	    nin, steps, nframe, dry);
+	exit(0);
+    }
+
+    while ((k = fread(in + nin, 1, size - nin, stdin)) > 0) {
+	nin += k;
+	if (nin == size) {
+	    in = (unsigned char *) realloc(in, size *= 2);
+	}
+    }
+    while (!done() || opin < nin || ord < nin || orem > 0 || oq > 0) {
+	tk++;
+	newtick();
+	oldtick();
+    }
+
+    printf("job %ld bytes, %ld ticks (%.3f s), %ld steps, link %g baud\n",
+	nin, tk, tk / FIRQ, steps, baud);
+    printf("old: %d bytes hold %d ticks (%.1f ms), dry %ld ticks\n",
+	NBUF, NBUF - 3, (NBUF - 3) / FIRQ * 1000.0, odry);
+    if (nfull > 0) {
+	printf("new: %d entries hold %ld..%.0f ticks (%.1f..%.1f ms), dry %ld ticks\n",
+	    NTICK, minfull, sumfull / nfull, minfull / FIRQ * 1000.0,
+	    sumfull / nfull / FIRQ * 1000.0, dry);
+    } else {
+	printf("new: %d entries never filled, dry %ld ticks\n", NTICK, dry);
+    }
+    exit(0);
+}
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "profile.h"
+
+//
+// trapezoid velocity profile shared by velo and rawstep.
+//
+// Each segment of length l starts at vs, ramps up at amax to a peak
+// vm <= vmax, cruises and ramps down to ve:
+//
+//	vm = min(vmax, sqrt((vs^2 + ve^2 + 2*amax*l)/2))
+//	s1 = (vm^2 - vs^2)/(2*amax)	; ramp up distance
+//	s3 = (vm^2 - ve^2)/(2*amax)	; ramp down distance
+//	s2 = l - s1 - s3		; cruise distance
+//
+// phases shorter than res/100 are dropped.
+//
+// With a jerk limit j > 0 each ramp is an S-curve instead: the
+// acceleration rises at j for tj, holds at amax for ta and falls at j
+// for tj, so a ramp from u to w takes
+//
+//	tj = amax/j, ta = (w - u)/amax - tj	if w - u >= amax^2/j
+//	tj = sqrt((w - u)/j), ta = 0		otherwise
+//
+// and, being symmetric, covers (u + w)/2*(2*tj + ta).  vm is the
+// largest speed whose two ramps fit in l, found by bisection, and the
+// distance into each ramp is turned back into time in closed form: a
+// cubic for the jerk phases and a quadratic for the constant
+// acceleration between them.  s1, s3, ts1 and ts2 keep their meaning.
+//
+
+#define NBISECT 60		// bisection passes for the S-curve vm
+
+// the kernel takes every array as a restrict parameter and has no
+// branches, so the compiler can vectorize it
+
+static void solve(int n, double eps,
+		  const double *restrict l, const double *restrict vs,
+		  const double *restrict ve, const double *restrict vmax,
+		  const double *restrict amax, double *restrict vm,
+		  double *restrict s1, double *restrict s2,
+		  double *restrict s3, double *restrict ts1,
+		  double *restrict ts2, double *restrict t)
+{
+    double a, v0, v1, m, r1, r2, r3, d, t1, t2;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	a = amax[i];
+	v0 = vs[i];
+	v1 = ve[i];
+
+	m = sqrt((v0 * v0 + v1 * v1 + 2.0 * a * l[i]) / 2.0);
+	m = (m < vmax[i]) ? m : vmax[i];
+
+	r1 = (m * m - v0 * v0) / (2.0 * a);
+	r1 = (fabs(r1) < eps) ? 0.0 : r1;
+	r3 = (m * m - v1 * v1) / (2.0 * a);
+	r3 = (fabs(r3) < eps) ? 0.0 : r3;
+	r2 = l[i] - r1 - r3;
+	r2 = (fabs(r2) < eps) ? 0.0 : r2;
+
+	t1 = (sqrt(v0 * v0 + 2.0 * a * r1) - v0) / a;
+	t2 = t1 + r2 / m;
+	d = l[i] - (r1 + r2);
+
+	vm[i] = m;
+	s1[i] = r1;
+	s2[i] = r2;
+	s3[i] = r3;
+	ts1[i] = t1;
+	ts2[i] = t2;
+	t[i] = t2 + (m - sqrt(fabs(m * m - 2.0 * a * d))) / a;
+    }
+}
+
+// jerk and constant acceleration times of an S-curve ramp from u to w
+
+static void ramp(double u, double w, double a, double j,
+		 double *tj, double *ta)
+{
+    double dv = w - u;
+
+    if (dv * j >= a * a) {
+	*tj = a / j;
+	*ta = dv / a - *tj;
+    } else {
+	*tj = sqrt(((dv > 0.0) ? dv : 0.0) / j);
+	*ta = 0.0;
+    }
+}
+
+// time and length of an S-curve ramp from u to w
+
+static double ramp_time(double u, double w, double a, double j)
+{
+    double tj, ta;
+
+    ramp(u, w, a, j, &tj, &ta);
+    return (2.0 * tj + ta);
+}
+
+static double ramp_len(double u, double w, double a, double j)
+{
+    return ((u + w) / 2.0 * ramp_time(u, w, a, j));
+}
+
+// the t >= 0 with v*t + j*t^3/6 = s (rising acceleration from zero).
+// Cardano with one real root, written as q/(c^2 + p/3 + (p/3c)^2)
+// so it keeps its precision when v dominates.
+
+static double cubic_up(double v, double j, double s)
+{
+    double p = 6.0 * v / j;
+    double q = 6.0 * s / j;
+    double c, e;
+
+    if (q <= 0.0) {
+	return (0.0);
+    }
+    c = cbrt(q / 2.0 + sqrt(q * q / 4.0 + p * p * p / 27.0));
+    e = p / (3.0 * c);
+    return (q / (c * c + p / 3.0 + e * e));
+}
+
+// the smallest t >= 0 with w*t - j*t^3/6 = r (acceleration falling to
+// zero at speed w, counted back from where it reaches zero).  Three
+// real roots, by the trigonometric form, then one Newton step for the
+// small root, which the cosine can only give to absolute precision.
+
+static double cubic_down(double w, double j, double r)
+{
+    double p = 6.0 * w / j;
+    double q = 6.0 * r / j;
+    double m, c, t, tk, f;
+    int k;
+
+    if (q <= 0.0) {
+	return (0.0);
+    }
+    m = 2.0 * sqrt(p / 3.0);
+    c = -1.5 * q / p * sqrt(3.0 / p);
+    c = (c < -1.0) ? -1.0 : (c > 1.0) ? 1.0 : c;
+    t = -1.0;
+    for (k = 0; k < 3; k++) {
+	tk = m * cos(acos(c) / 3.0 - 2.0 * M_PI * k / 3.0);
+	if (tk >= 0.0 && (t < 0.0 || tk < t)) {
+	    t = tk;
+	}
+    }
+    f = w - j * t * t / 2.0;
+    if (f > 0.0) {
+	t -= (w * t - j * t * t * t / 6.0 - r) / f;
+    }
+    return (t);
+}
+
+// time to get x into an S-curve ramp from u up to w
+
+static double ramp_at(double u, double w, double a, double j, double x)
+{
+    double tj, ta, ap, v1, d1, d2, tt, ll;
+
+    ramp(u, w, a, j, &tj, &ta);
+    tt = 2.0 * tj + ta;
+    ll = (u + w) / 2.0 * tt;
+    if (x >= ll) {
+	return (tt);
+    }
+    ap = j * tj;			// peak acceleration
+    v1 = u + ap * tj / 2.0;
+    d1 = u * tj + j * tj * tj * tj / 6.0;
+    d2 = v1 * ta + ap * ta * ta / 2.0;
+
+    if (x < d1) {			// acceleration rising
+	return (cubic_up(u, j, x));
+    } else if (x < d1 + d2) {		// acceleration held
+	return (tj + (sqrt(v1 * v1 + 2.0 * ap * (x - d1)) - v1) / ap);
+    }
+    return (tt - cubic_down(w, j, ll - x));	// acceleration falling
+}
+
+// solve segment i as an S-curve with jerk limit j
+
+static void solve_jerk(PROFILE *p, int i, double eps)
+{
+    double a = p->amax[i];
+    double j = p->jmax[i];
+    double v0 = p->vs[i];
+    double v1 = p->ve[i];
+    double lo = (v0 > v1) ? v0 : v1;
+    double hi = (p->vmax[i] > lo) ? p->vmax[i] : lo;
+    double m, r1, r2, r3;
+    int k;
+
+    if (ramp_len(v0, hi, a, j) + ramp_len(v1, hi, a, j) <= p->l[i]) {
+	m = hi;
+    } else {
+	for (k = 0; k < NBISECT; k++) {
+	    m = (lo + hi) / 2.0;
+	    if (ramp_len(v0, m, a, j) + ramp_len(v1, m, a, j) <= p->l[i]) {
+		lo = m;
+	    } else {
+		hi = m;
+	    }
+	}
+	m = lo;
+    }
+
+    r1 = ramp_len(v0, m, a, j);
+    r1 = (fabs(r1) < eps) ? 0.0 : r1;
+    r3 = ramp_len(v1, m, a, j);
+    r3 = (fabs(r3) < eps) ? 0.0 : r3;
+    r2 = p->l[i] - r1 - r3;
+    r2 = (r2 < eps) ? 0.0 : r2;
+
+    p->vm[i] = m;
+    p->s1[i] = r1;
+    p->s2[i] = r2;
+    p->s3[i] = r3;
+    p->ts1[i] = ramp_time(v0, m, a, j);
+    p->ts2[i] = p->ts1[i] + ((r2 > 0.0) ? r2 / m : 0.0);
+    p->t[i] = p->ts2[i] + ramp_time(v1, m, a, j);
+}
+
+// solve all p->n segments into the caller's output arrays
+
+void profile_solve(PROFILE *p, double res)
+{
+    int i;
+
+    solve(p->n, res / 100.0, p->l, p->vs, p->ve, p->vmax, p->amax,
+	  p->vm, p->s1, p->s2, p->s3, p->ts1, p->ts2, p->t);
+
+    if (p->jmax != NULL) {
+	for (i = 0; i < p->n; i++) {
+	    if (p->jmax[i] > 0.0) {
+		solve_jerk(p, i, res / 100.0);
+	    }
+	}
+    }
+}
+
+// the speed reached from v0 over distance l at acceleration a and
+// jerk j (0 for a trapezoid), for lookahead limits.  The S-curve is a
+// cubic in sqrt(dv/j) while the ramp is too short to reach a, and a
+// quadratic in dv once it does.
+
+double profile_reach(double v0, double a, double j, double l)
+{
+    double s, dv, b, c;
+
+    if (j <= 0.0) {
+	return (sqrt(pow(v0, 2.0) + 2.0 * a * l));
+    }
+    s = cubic_up(2.0 * v0, 6.0 * j, l);
+    dv = j * s * s;
+    if (dv * j < a * a) {
+	return (v0 + dv);
+    }
+    b = 2.0 * v0 + a * a / j;
+    c = 2.0 * a * (v0 * a / j - l);
+    return (v0 - 2.0 * c / (b + sqrt(b * b - 4.0 * c)));
+}
+
+// return the time it takes to get distance l into segment i, and
+// optionally which phase of the profile that is in
+
+double profile_time(PROFILE *p, int i, double l, int *phase)
+{
+    double a = p->amax[i];
+    double vs = p->vs[i];
+    double vm = p->vm[i];
+    double s1 = p->s1[i];
+    double s2 = p->s2[i];
+    double j = (p->jmax != NULL) ? p->jmax[i] : 0.0;
+    double tt;
+    int pen;
+
+    if (j > 0.0) {
+	if (l < s1) {
+	    tt = ramp_at(vs, vm, a, j, l);
+	    pen = ACCEL;
+	} else if (l < s1 + s2) {
+	    tt = p->ts1[i] + (l - s1) / vm;
+	    pen = CRUISE;
+	} else {
+	    tt = p->t[i] - ramp_at(p->ve[i], vm, a, j, p->l[i] - l);
+	    pen = DECEL;
+	}
+    } else if (l < s1) {		// accellerating
+	tt = (sqrt(vs * vs + 2.0 * a * l) - vs) / a;
+	pen = ACCEL;
+    } else if (l < s1 + s2) {	// cruising
+	tt = p->ts1[i] + (l - s1) / vm;
+	pen = CRUISE;
+    } else {			// decellerating
+	tt = p->ts2[i] + (vm - sqrt(fabs(vm * vm - 2.0 * a * (l - (s2 + s1))))) / a;
+	pen = DECEL;
+    }
+    if (phase != NULL) {
+	*phase = pen;
+    }
+    return (tt);
+}
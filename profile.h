@@ -0,0 +1,28 @@
+// structure of arrays for solving many trapezoid (or jerk limited
+// S-curve) velocity profiles at once.  All arrays are owned by the
+// caller and hold n entries.
+
+typedef struct profile {
+    int n;		// number of segments
+    double *l;		// segment length
+    double *vs;		// starting speed
+    double *ve;		// ending speed
+    double *vmax;	// maximum speed
+    double *amax;	// maximum acceleration
+    double *vm;		// peak speed reached
+    double *s1;		// distance from start to reach vm
+    double *s2;		// distance cruising at vm
+    double *s3;		// distance from end of cruise to end
+    double *ts1;	// time to reach s1
+    double *ts2;	// time to reach s1+s2
+    double *t;		// time to reach l
+    double *jmax;	// jerk limit, NULL or 0 for a trapezoid
+} PROFILE;
+
+#define ACCEL	2	// profile phases, see profile_time()
+#define CRUISE	3
+#define DECEL	4
+
+extern void profile_solve(PROFILE *p, double res);
+extern double profile_time(PROFILE *p, int i, double l, int *phase);
+extern double profile_reach(double v0, double a, double j, double l);
@@ -1,7 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 #include <math.h>
+#include <float.h>
 #include "stepper.h"
 #include "bytecodes.h"
 
@@ -11,11 +13,230 @@
 
 int debug=0;
 
+// the shortest step interval of a stroke sampled every res is next to
+// the peak velocity: in the cruise it is res/vm, otherwise it is one of
+// the intervals around the ends of the ramps at s1 and s1+s2.  Only
+// intervals ending at or after 2*res and before l are considered.  The
+// step times are floats, so an interval can come out a few ulps of the
+// tick time short of that; TMARGIN of them are taken off to cover it.
+
+#define TMARGIN 2.0		// float ulps of the stroke time
+
+float min_interval(STEPPARM *s, float l, float res) {
+    float dt, ll;
+    float tmin=-1.0;
+    float margin = TMARGIN*FLT_EPSILON*s->t;
+    float e[2];
+    int i, k;
+
+    if (s->s2 >= res) {
+	return res/s->vm - margin;
+    }
+    e[0] = s->s1;
+    e[1] = s->s1 + s->s2;
+    for (i=0; i<2; i++) {
+	for (k=(int)(e[i]/res)-1; k<=(int)(e[i]/res)+2; k++) {
+	    ll = k*res;
+	    if (ll < 2.0*res || ll >= l) continue;
+	    dt = fabs(time_at_l(s, ll)-time_at_l(s, ll-res));
+	    if (tmin < 0.0 || dt < tmin) tmin=dt;
+	}
+    }
+    return tmin < 0.0 ? tmin : tmin - margin;
+}
+
+// several pumps on one controller, one per axis, each with its own
+// stroke profile (-P, once per pump)
+
+#define NCHAN 4
+#define MINSTEP 12.0		// fewest ticks between steps of a pump
+
+typedef struct channel {
+    STEPPARM s;			// stroke profile, in profile time
+    float l;			// stroke (steps)
+    float period;		// seconds per stroke and back
+    float amax;
+    float vmax;
+    float jmax;
+    long n;			// steps each way
+    double cycletime;		// profile time of a stroke and back
+    long k;			// steps into this cycle, 0..2n-1
+    long cycle;			// cycles done
+    double next;		// tick of step k
+} CHANNEL;
+
+CHANNEL chan[NCHAN];
+char *chanspec[NCHAN];
+int nchan = 0;
+
+// fill in c from a spec like "s=1200,p=2,a=1,v=10,j=5" or "f=50" (flow in
+// ul/min, sets the stroke and period as -f does); keys not given keep
+// the values c already has.  Returns 0 on a bad spec.
+
+int chan_parse(CHANNEL *c, char *spec) {
+    char *tok, *v;
+    float flow;
+
+    spec = strdup(spec);
+    for (tok = strtok(spec, ","); tok != NULL; tok = strtok(NULL, ",")) {
+	if ((v = strchr(tok, '=')) == NULL || v != tok + 1) {
+	    return (0);
+	}
+	v++;
+	switch (*tok) {
+	    case 's': c->l = atof(v); break;
+	    case 'p': c->period = atof(v); break;
+	    case 'a': c->amax = atof(v); break;
+	    case 'v': c->vmax = atof(v); break;
+	    case 'j': c->jmax = atof(v); break;
+	    case 'f':
+		flow = atof(v);
+		c->l = FULLSTROKE*sqrt(flow/2279.0);
+		c->period = 2.0*(ULPERREV*60.0*c->l)/(flow*STEPPERREV);
+		break;
+	    default:
+		return (0);
+	}
+    }
+    return (c->l > 0.0 && c->period > 0.0 && c->amax > 0.0 && c->vmax > 0.0);
+}
+
+// absolute tick of the next step of c: forward steps k = 0..n-1 run
+// out to l, then the same profile back to 0
+
+double chan_tick(CHANNEL *c, float fstep) {
+    double t;
+
+    if (c->k < c->n) {
+	t = time_at_l(&c->s, (c->k+1)*c->s.res);
+    } else {
+	t = c->cycletime - time_at_l(&c->s, c->l - (c->k - c->n + 1)*c->s.res);
+    }
+    return ((c->cycle + t/c->cycletime)*c->period*fstep);
+}
+
+// closest steps of c in ticks at its current resolution
+
+float chan_minstep(CHANNEL *c, float fstep) {
+    float stepdel = min_interval(&c->s, c->l, c->s.res);
+
+    if (stepdel < 0.0) {
+	return (1000.0);
+    }
+    return (stepdel*c->period*fstep/c->cycletime);
+}
+
+// run the channels together.  Every step time is worked out from the
+// start of the job, so no pump drifts against another, and the steps
+// of all of them are merged in time order.  Steps due on the same tick
+// go out as one STEP mask, and since the firmware spends a tick on
+// every step the delay before a step is one less than the tick gap.
+
+void multi(float fstep, float interp, float time_limit) {
+    CHANNEL *c;
+    long long tick, last = -1, limit;
+    float minstep = -1.0;
+    float m;
+    int i, mask, dirmask, lastdir = -1;
+
+    for (i = 0; i < nchan; i++) {
+	c = &chan[i];
+	stepper_set_parms(&c->s, c->l, 0.0, 0.0, c->amax, c->vmax, c->jmax, 1.0);
+	c->cycletime = 2.0*time_at_l(&c->s, c->l);
+	m = chan_minstep(c, fstep);
+	if (minstep < 0.0 || m < minstep) {
+	    minstep = m;
+	}
+    }
+
+    // the finest mode that keeps every pump's steps far enough apart
+
+    while (interp > 1.0 && minstep/interp < MINSTEP) {
+	interp /= 2.0;
+    }
+    if (minstep/interp < MINSTEP) {
+	fprintf(stderr, "step size too small, either decrease stroke or increase cycle time: interp:%f minstep:%f\n", interp, minstep);
+	exit(7);
+    }
+
+    // a stroke of whole microsteps, so the way back retraces the steps
+    // of the way out
+
+    for (i = 0; i < nchan; i++) {
+	c = &chan[i];
+	c->n = (long) floor(c->l*interp);
+	if (c->n < 1) {
+	    fprintf(stderr, "%c: stroke under one step\n", "xyzw"[i]);
+	    exit(7);
+	}
+	c->l = c->n/interp;
+	stepper_set_parms(&c->s, c->l, 0.0, 0.0, c->amax, c->vmax, c->jmax, 1.0/interp);
+	c->cycletime = 2.0*time_at_l(&c->s, c->l);
+	c->k = c->cycle = 0;
+	c->next = chan_tick(c, fstep);
+	fprintf(stderr, "%c: stroke %f steps, period %f, flow %f uL/min, minstep %f\n",
+	    "xyzw"[i], c->l, c->period, 
+	    2.0*ULPERREV*(c->l/STEPPERREV)*(60.0/c->period), 
+	    chan_minstep(c, fstep));
+    }
+    fprintf(stderr, "interp:%f\n", interp);
+
+    mode(interp2mode(interp));
+    limit = llround(60.0*time_limit*fstep);
+
+    for (;;) {
+	tick = -1;
+	for (i = 0; i < nchan; i++) {
+	    if (tick < 0 || llround(chan[i].next) < tick) {
+		tick = llround(chan[i].next);
+	    }
+	}
+	if (limit > 0 && tick > limit) {
+	    exit(0);
+	}
+
+	// a pump on its way back has its direction bit set, as dir(0)
+
+	mask = dirmask = 0;
+	for (i = 0; i < nchan; i++) {
+	    if (llround(chan[i].next) == tick) {
+		mask |= 1<<i;
+	    }
+	    if (chan[i].k >= chan[i].n) {
+		dirmask |= 1<<i;
+	    }
+	}
+	if (dirmask != lastdir) {
+	    dirs(dirmask);
+	    lastdir = dirmask;
+	}
+	delay((last < 0) ? tick : tick - last - 1);
+	step(mask);
+	last = tick;
+
+	for (i = 0; i < nchan; i++) {
+	    c = &chan[i];
+	    if (mask & (1<<i)) {
+		if (++c->k == 2*c->n) {
+		    c->k = 0;
+		    c->cycle++;
+		}
+		c->next = chan_tick(c, fstep);
+	    }
+	}
+	if (ferror(stdout)) {
+	    exit(1);
+	}
+    }
+}
+
 int main(int argc, char **argv) {
     int i;
 
     float ll;
-    STEPPARM *s=NULL;
+    unsigned char *cycle;	// one full stroke of bytecodes
+    int ncycle;
+    STEPPARM sp, *s=&sp;
 
     float l=200.0;
     float res=1.0;	// compute integer steps
@@ -25,10 +246,14 @@ int main(int argc, char **argv) {
 
     float vmax=10.0;
     float amax=1.0;
+    float jmax=0.0;		// jerk limit, 0 for trapezoid strokes
     float fstep=20000.0;
     int zero=0;
+    int fwloop=0;		// let the firmware repeat the cycle
+    int ncycles=0;
     float interp=1.0;
     int modeset=0;
+    int setmode=0;		// -m given
     float time_limit=0.0;	// run time in minutes (0=forever)
 
     float cycletime=0.0;	// in arbitrary units
@@ -40,14 +265,28 @@ int main(int argc, char **argv) {
     int errflg = 0;
     int c;
 
-    while ((c = getopt(argc, argv, "a:c:p:d:f:m:r:s:t:v:z")) != EOF) {
+    while ((c = getopt(argc, argv, "a:c:lp:P:d:f:j:m:r:s:t:v:z")) != EOF) {
 	 switch (c) {
 		case 'a':                       // set acceleration limit
 		    amax = atof(optarg);
 		    break;
+		case 'j':                       // set jerk limit
+		    jmax = atof(optarg);
+		    break;
+		case 'l':                       // use firmware loop
+		    fwloop++;
+		    break;
 		case 'p':                       // set period in seconds
 		    period = atof(optarg);
 		    break;
+		case 'P':                       // add a pump on the next axis
+		    if (nchan == NCHAN) {
+			fprintf(stderr, "%s error: at most %d pumps\n", argv[0], NCHAN);
+			errflg++;
+		    } else {
+			chanspec[nchan++] = optarg;
+		    }
+		    break;
 		case 'd':
 		    debug = atof(optarg);
 		    break;
@@ -61,6 +300,7 @@ int main(int argc, char **argv) {
 		    break;
 		case 'm':                       // set stepper mode
 		    interp = atof(optarg);
+		    setmode++;
 		    if ((modeset=interp2mode(interp)) < 0) {
 			fprintf(stderr, "%s error: -s <mode> is one of 1,2,4,8 or 16\n", argv[0]);
 			errflg++;
@@ -90,7 +330,11 @@ int main(int argc, char **argv) {
             fprintf(stderr, "     -d <debug>   ; verbose debugging bitmask\n");
 	    fprintf(stderr, "     -c <fstep>   ; stepper update frequency (default=%f)\n", fstep);
 	    fprintf(stderr, "     -f <uliters> ; set flow in ul/min (default=%f)\n", flow);
+	    fprintf(stderr, "     -j <jmax>    ; set jerk limit, 0 for a trapezoid (default=%f)\n", jmax);
+	    fprintf(stderr, "     -l           ; send one cycle and loop it in firmware (default off)\n");
 	    fprintf(stderr, "     -p <period>  ; set stroke period in seconds (default=%f)\n", period);
+	    fprintf(stderr, "     -P <s=,p=,f=,a=,v=,j=> ; add a pump with its own stroke, period,\n");
+	    fprintf(stderr, "                    flow, amax, vmax, jmax (default the above), one per axis\n");
 	    fprintf(stderr, "     -s <count>   ; set steps pk/pk (default=%f)\n", l);
 	    fprintf(stderr, "     -t <minutes> ; turn off time (default=%f)\n", time_limit);
 	    fprintf(stderr, "     -m <factor>  ; set interpolation mode (default = %f)\n", interp);
@@ -100,11 +344,30 @@ int main(int argc, char **argv) {
     }
 
 
-    // stepper_set_parms(float l, float vs, float ve, float amax, float vmax, float res) {
+    // each pump starts from the settings above
 
-    if ((s=stepper_set_parms(l, 0.0, 0.0, amax, vmax, res)) == NULL) {
-        fatal("STEPPARM malloc error");
+    for (i = 0; i < nchan; i++) {
+	chan[i].l = l;
+	chan[i].period = period;
+	chan[i].amax = amax;
+	chan[i].vmax = vmax;
+	chan[i].jmax = jmax;
+	if (!chan_parse(&chan[i], chanspec[i])) {
+	    fprintf(stderr, "%s error: bad pump profile %s\n", argv[0], chanspec[i]);
+	    exit(1);
+	}
     }
+    if (nchan > 0) {
+	if (fwloop) {
+	    fprintf(stderr, "pumps don't share a cycle, streaming\n");
+	}
+	if (zero) center(FULLSTROKE);
+	multi(fstep, setmode ? interp : 16.0, time_limit);
+    }
+
+    // stepper_set_parms(STEPPARM *s, float l, float vs, float ve, float amax, float vmax, float jmax, float res) {
+
+    stepper_set_parms(s, l, 0.0, 0.0, amax, vmax, jmax, res);
 
     cycletime = 2.0*time_at_l(s, l);
 
@@ -118,14 +381,11 @@ int main(int argc, char **argv) {
     fprintf(stderr, "period is %f\n", period);
     fprintf(stderr, "flow is %f uL/min \n", 2.0*ULPERREV*(l/STEPPERREV)*(60.0/period));
 
-    // do a dry run to compute the minimum step time in fstep clock cycles
+    // compute the minimum step time in fstep clock cycles
     float minstep=1000.0;
-    float stepdel=0.0;
-    int n=0;
-    for (ll=0; ll<l; ll+=res) {		// forward direction
-	  t1=t0; t0 = time_at_l(s, ll); n++;
-	  stepdel = roundf(fabs((t0-t1)*period*fstep/cycletime));
-	  if (stepdel < minstep && (n>2)) minstep=stepdel;
+    float stepdel=min_interval(s, l, res);
+    if (stepdel >= 0.0) {
+	minstep = roundf(stepdel*period*fstep/cycletime);
     }
     fprintf(stderr, "minstep is %f\n", minstep);
 
@@ -188,25 +448,57 @@ int main(int argc, char **argv) {
 
     mode(modeset); // set stepper interpolation 
     float total_time=0.0;
+
+    // every stroke is the same, so compute one forward and reverse
+    // cycle of bytecodes once and replay it
 	
-    while (1) {
-	// fprintf(stderr, "time = %f\n", total_time);
-	dir(1);
+    bc_record();
+    dir(1);
+
+    t0 = time_at_l(s,res);
+    for (ll=res; ll<l; ll+=res) {           // forward direction
+	  t1=t0; t0 = time_at_l(s, ll);
+	  delay((int) fabs((t0-t1)*period*fstep/cycletime));
+	  step(7);
+	  // if (debug) printf("%f %f %f %f\n", ll, t0-t1, t0, fabs((t0-t1)*fstep*period/cycletime));
+    }
 
-	t0 = time_at_l(s,res);
-	for (ll=res; ll<l; ll+=res) {		// forward direction
-	      t1=t0; t0 = time_at_l(s, ll);
-	      delay((int) fabs((t0-t1)*period*fstep/cycletime));
-	      step(7);
-	      // if (debug) printf("%f %f %f %f\n", ll, t0-t1, t0, fabs((t0-t1)*fstep*period/cycletime));
+    dir(0);
+    for (ll=l; ll>=0; ll-=res) {            // reverse direction
+	  t1=t0; t0 = time_at_l(s, ll);
+	  delay((int) fabs((t0-t1)*period*fstep/cycletime));
+	  step(7);
+	  // if (debug) printf("%f %f %f %f\n", ll, t0-t1, t0, fabs((t0-t1)*fstep*period/cycletime));
+    }
+    cycle = bc_stop(&ncycle);
+
+    // hand the cycle to the firmware loop, counting out the same
+    // number of cycles the streaming loop below would send
+
+    if (fwloop && ncycle > LOOPMAX) {
+	fprintf(stderr, "cycle is %d bytes, too long for firmware loop (%d), streaming\n",
+	    ncycle, LOOPMAX);
+    } else if (fwloop) {
+	if (time_limit > 0.0) {
+	    do {
+		ncycles++;
+		total_time += period;
+	    } while (total_time <= (60.0*time_limit));
 	}
+	do {
+	    i = (ncycles > LOOPCNT) ? LOOPCNT : ncycles;
+	    loop_begin();
+	    fwrite(cycle, 1, ncycle, stdout);
+	    loop_end(i);
+	    ncycles -= i;
+	} while (ncycles > 0);
+	exit(0);
+    }
 
-	dir(0);
-	for (ll=l; ll>=0; ll-=res) {		// reverse direction
-	      t1=t0; t0 = time_at_l(s, ll);
-	      delay((int) fabs((t0-t1)*period*fstep/cycletime));
-	      step(7);
-	      // if (debug) printf("%f %f %f %f\n", ll, t0-t1, t0, fabs((t0-t1)*fstep*period/cycletime));
+    while (1) {
+	// fprintf(stderr, "time = %f\n", total_time);
+	if (fwrite(cycle, 1, ncycle, stdout) != ncycle) {
+	    exit(1);
 	}
 
 	total_time += period;
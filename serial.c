@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#else
+#include <termios.h>
+#endif
+
+#include "serial.h"
+
+//
+// serial link to the step generator, shared by feed and jog.
+//
+// The port is put in raw 8N1 mode with RTS/CTS flow control (the
+// firmware drops CTS when its queue fills).  On linux any baud rate
+// can be set with termios2 and BOTHER, so FTDI parts can run at
+// 921600 to 3M, and the driver is asked for low latency so short
+// writes aren't held back by its receive timer.
+//
+
+#define TIMEOUT 1		// inter-char read timer (decisecs)
+#define BUFSIZE 4096		// stdio buffer for writes
+#define NPORT 8			// ports open at once
+
+static int fd = -1;		// the last port opened, for serial_read()
+
+// settings to put back on every open port
+
+static struct port {
+    int fd;
+#ifdef __linux__
+    struct termios2 oldtio;
+#else
+    struct termios oldtio;
+#endif
+} ports[NPORT];
+static int nports = 0;
+
+#ifndef __linux__
+// standard rates only without termios2
+
+static speed_t baudcode(int baud)
+{
+    switch (baud) {
+	case 9600:	return (B9600);
+	case 19200:	return (B19200);
+	case 38400:	return (B38400);
+	case 57600:	return (B57600);
+	case 115200:	return (B115200);
+	case 230400:	return (B230400);
+    }
+    return (0);
+}
+#endif
+
+// open dev at baud, returns a FILE for writing byte codes
+
+FILE *serial_open(char *dev, int baud)
+{
+    FILE *f;
+
+    if (nports == NPORT) {
+	fprintf(stderr, "%s: more than %d ports\n", dev, NPORT);
+	exit(-1);
+    }
+    if ((fd = open(dev, O_RDWR | O_NOCTTY)) < 0) {
+	perror(dev);
+	exit(-1);
+    }
+    ports[nports].fd = fd;
+
+#ifdef __linux__
+    struct termios2 tio;
+    struct serial_struct ss;
+
+    if (ioctl(fd, TCGETS2, &ports[nports].oldtio) < 0) {
+	perror(dev);
+	exit(-1);
+    }
+    tio = ports[nports].oldtio;
+    tio.c_iflag = IGNPAR;
+    tio.c_oflag = 0;
+    tio.c_lflag = 0;		// non-canonical, no echo, ...
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT) | CSIZE | PARENB | CSTOPB);
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT) | CS8 | CREAD | CLOCAL | CRTSCTS;
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+    tio.c_cc[VTIME] = TIMEOUT;
+    tio.c_cc[VMIN] = 0;
+    if (ioctl(fd, TCSETS2, &tio) < 0) {
+	fprintf(stderr, "%s: can't set %d baud\n", dev, baud);
+	exit(-1);
+    }
+
+    // the driver may only come close to the rate asked for
+
+    if (ioctl(fd, TCGETS2, &tio) == 0 && 
+	(tio.c_ospeed < baud * 0.97 || tio.c_ospeed > baud * 1.03)) {
+	fprintf(stderr, "%s: asked for %d baud, got %d\n", dev, baud, 
+	    tio.c_ospeed);
+    }
+
+    // not every driver has a low latency mode, that's fine
+
+    if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+	ss.flags |= ASYNC_LOW_LATENCY;
+	ioctl(fd, TIOCSSERIAL, &ss);
+    }
+    ioctl(fd, TCFLSH, TCIFLUSH);
+#else
+    struct termios tio;
+
+    if (baudcode(baud) == 0) {
+	fprintf(stderr, "%s: %d baud needs termios2\n", dev, baud);
+	exit(-1);
+    }
+    tcgetattr(fd, &ports[nports].oldtio);
+    tio = ports[nports].oldtio;
+    cfmakeraw(&tio);
+    tio.c_cflag |= CREAD | CLOCAL | CRTSCTS;
+    cfsetispeed(&tio, baudcode(baud));
+    cfsetospeed(&tio, baudcode(baud));
+    tio.c_cc[VTIME] = TIMEOUT;
+    tio.c_cc[VMIN] = 0;
+    tcflush(fd, TCIFLUSH);
+    tcsetattr(fd, TCSANOW, &tio);
+#endif
+
+    // the stream only writes; replies come in through serial_read()
+    // on the bare fd.  So stdio never turns the stream around, which
+    // would need a seek that a tty can't do.
+
+    if ((f = fdopen(fd, "w")) == NULL) {
+	fprintf(stderr, "can't open %s!\n", dev);
+	exit(1);
+    }
+    setvbuf(f, NULL, _IOFBF, BUFSIZE);
+    nports++;
+    return (f);
+}
+
+// read what the device has sent back, waiting up to ms for the
+// first byte.  Returns the bytes read, 0 if none came.
+
+int serial_read(unsigned char *buf, int n, int ms)
+{
+    struct pollfd p;
+    int k;
+
+    p.fd = fd;
+    p.events = POLLIN;
+    if (poll(&p, 1, ms) <= 0 || (k = read(fd, buf, n)) < 0) {
+	return (0);
+    }
+    return (k);
+}
+
+// drain what is queued and put the port back the way we found it
+
+void serial_close(FILE *f)
+{
+    int pfd = fileno(f);
+    int i;
+
+    fflush(f);
+    for (i = 0; i < nports && ports[i].fd != pfd; i++) {
+	;
+    }
+    if (i < nports) {
+#ifdef __linux__
+	ioctl(pfd, TCSBRK, 1);
+	ioctl(pfd, TCSETS2, &ports[i].oldtio);
+#else
+	tcdrain(pfd);
+	tcsetattr(pfd, TCSANOW, &ports[i].oldtio);
+#endif
+	ports[i] = ports[--nports];
+    }
+    fclose(f);
+    if (pfd == fd) {
+	fd = -1;
+    }
+}
@@ -0,0 +1,6 @@
+#define SERIAL_DEV  "/dev/ttyUSB0"	// default device
+#define SERIAL_BAUD 230400		// default baud rate
+
+extern FILE *serial_open(char *dev, int baud);
+extern int serial_read(unsigned char *buf, int n, int ms);
+extern void serial_close(FILE *f);
@@ -0,0 +1,448 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "serve.h"
+
+//
+// velo daemon.  Listens on a Unix stream socket, where each
+// connection sends one request line and, for a job, its path input:
+//
+//	run [velo options]	plan it to the daemon's stdout (the device)
+//	plan [velo options]	plan it back on this connection
+//	queue			list the jobs waiting and running
+//	status			totals since the daemon started
+//
+// The input ends when the client shuts down its side.  Run jobs are
+// planned one at a time in the order their input came in, each
+// straight after the last, so a feed reading the daemon's stdout gets
+// one unbroken stream.  Plan jobs start as soon as their input is in.
+// The daemon parses its options, loads the machine profile and checks
+// the limits once; every job is planned in a fork of it, so it starts
+// from that state and nothing a job does to the planner carries over
+// to the next.  Options on the request line go on top of the daemon's.
+//
+
+#define NJOB 64			// connections and jobs at once
+#define MAXREQ 512		// request line
+#define MAXARGS 32		// velo options per job
+#define WAITMS 20		// poll for finished jobs this often
+
+enum { FREE, READING, QUEUED, RUNNING };
+
+typedef struct job {
+    int state;
+    int fd;			// client connection, -1 once closed
+    int id;
+    int kind;			// JOB_RUN, JOB_PLAN, 0 until the request
+    char req[MAXREQ];		// request line
+    int nreq;
+    FILE *in;			// path input
+    long nin;
+    long seq;			// order the input was complete in
+    pid_t pid;
+    double t0;			// connected, then started
+} JOB;
+
+static JOB jobs[NJOB];
+static int ls = -1;		// listening socket
+static int nid = 0;
+static long nseq = 0;
+static long ndone = 0, nfail = 0;
+static double tstart;
+
+static char *state[] = { "free", "reading", "queued", "running" };
+
+static double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec + t.tv_nsec * 1e-9);
+}
+
+// send a line to the client, if it is still there
+
+static void reply(JOB *j, char *fmt, ...)
+{
+    char s[MAXREQ + 128];
+    va_list ap;
+
+    if (j->fd < 0) {
+	return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(s, sizeof(s), fmt, ap);
+    va_end(ap);
+    if (write(j->fd, s, strlen(s)) < 0) {
+	close(j->fd);
+	j->fd = -1;
+    }
+}
+
+static void drop(JOB *j)
+{
+    if (j->fd >= 0) {
+	close(j->fd);
+    }
+    if (j->in != NULL) {
+	fclose(j->in);
+    }
+    memset(j, 0, sizeof(*j));
+    j->fd = -1;
+}
+
+// the options on the request line, after the command word
+
+static char *args(JOB *j)
+{
+    char *s = j->req + strcspn(j->req, " \t");
+
+    return (s + strspn(s, " \t"));
+}
+
+static void queue(JOB *me)
+{
+    JOB *j;
+    long seq;
+    int k, first;
+
+    // running and queued jobs in their order, then the ones still
+    // sending their input
+
+    for (seq = -1;; seq = jobs[first].seq) {
+	for (k = 0, first = -1; k < NJOB; k++) {
+	    j = &jobs[k];
+	    if ((j->state == QUEUED || j->state == RUNNING) && j->seq > seq &&
+		(first < 0 || j->seq < jobs[first].seq)) {
+		first = k;
+	    }
+	}
+	if (first < 0) {
+	    break;
+	}
+	j = &jobs[first];
+	reply(me, "%d %s %s %ld bytes %.1f s %s\n", j->id, state[j->state],
+	    (j->kind == JOB_RUN) ? "run" : "plan", j->nin, now() - j->t0, args(j));
+    }
+    for (k = 0; k < NJOB; k++) {
+	j = &jobs[k];
+	if (j->state == READING && j->kind != 0) {
+	    reply(me, "%d %s %s %ld bytes %.1f s %s\n", j->id, state[j->state],
+		(j->kind == JOB_RUN) ? "run" : "plan", j->nin, now() - j->t0, args(j));
+	}
+    }
+}
+
+static void status(JOB *me)
+{
+    int k, n[4];
+
+    n[READING] = n[QUEUED] = n[RUNNING] = 0;
+    for (k = 0; k < NJOB; k++) {
+	if (jobs[k].kind != 0) {
+	    n[jobs[k].state]++;
+	}
+    }
+    reply(me, "up %.0f s jobs %d done %ld failed %ld running %d queued %d reading %d\n",
+	now() - tstart, nid, ndone, nfail, n[RUNNING], n[QUEUED], n[READING]);
+}
+
+// the request line is in
+
+static void request(JOB *j)
+{
+    int k = strcspn(j->req, " \t");
+
+    if (k == 3 && strncmp(j->req, "run", 3) == 0) {
+	j->kind = JOB_RUN;
+    } else if (k == 4 && strncmp(j->req, "plan", 4) == 0) {
+	j->kind = JOB_PLAN;
+    } else if (k == 5 && strncmp(j->req, "queue", 5) == 0) {
+	queue(j);
+	drop(j);
+	return;
+    } else if (k == 6 && strncmp(j->req, "status", 6) == 0) {
+	status(j);
+	drop(j);
+	return;
+    } else {
+	reply(j, "error: unknown request \"%s\"\n", j->req);
+	drop(j);
+	return;
+    }
+    if ((j->in = tmpfile()) == NULL) {
+	reply(j, "error: no room for the input\n");
+	drop(j);
+	return;
+    }
+    j->id = ++nid;
+}
+
+// read what the client sent: the request line, then the input
+
+static void input(JOB *j)
+{
+    char b[4096], *e;
+    int k, m;
+
+    if ((k = read(j->fd, b, sizeof(b))) < 0) {
+	if (errno != EINTR) {
+	    drop(j);		// never queue a job cut short
+	}
+	return;
+    }
+    if (j->kind == 0) {
+	if (k == 0) {
+	    drop(j);
+	    return;
+	}
+	e = memchr(b, '\n', k);
+	m = (e != NULL) ? e - b : k;
+	if (j->nreq + m >= MAXREQ) {
+	    reply(j, "error: request too long\n");
+	    drop(j);
+	    return;
+	}
+	memcpy(j->req + j->nreq, b, m);
+	j->nreq += m;
+	if (e == NULL) {
+	    return;
+	}
+	j->req[j->nreq] = '\0';
+	request(j);
+	if (j->kind == 0) {
+	    return;
+	}
+	memmove(b, e + 1, k - m - 1);
+	if ((k -= m + 1) == 0) {
+	    return;
+	}
+    }
+    if (k > 0) {
+	fwrite(b, 1, k, j->in);
+	j->nin += k;
+	return;
+    }
+    if (fflush(j->in) != 0 || ferror(j->in)) {
+	reply(j, "error: no room for the input\n");
+	drop(j);
+	return;
+    }
+    j->state = QUEUED;
+    j->seq = nseq++;
+    if (j->kind == JOB_RUN) {
+	for (k = 0, m = 0; k < NJOB; k++) {
+	    if (jobs[k].kind == JOB_RUN && jobs[k].state >= QUEUED) {
+		m++;
+	    }
+	}
+	reply(j, "queued %d, %d ahead\n", j->id, m - 1);
+    }
+}
+
+// fork job j.  Returns its kind in the child, with its input on
+// stdin, its output on stdout and its options in *argc, *argv.
+
+static int start(JOB *j, char *prog, int *argc, char ***argv)
+{
+    static char *av[MAXARGS + 2];
+    char *tok;
+    pid_t pid;
+    int k;
+
+    // the child would write what is still buffered of other jobs'
+    // input into their files again when it exits, so flush it all now
+
+    fflush(NULL);
+    if ((pid = fork()) < 0) {
+	reply(j, "done %d FAIL can't fork\n", j->id);
+	nfail++;
+	drop(j);
+	return (0);
+    }
+    if (pid > 0) {
+	j->pid = pid;
+	j->state = RUNNING;
+	j->t0 = now();
+	if (j->kind == JOB_PLAN) {
+	    close(j->fd);		// the client sees the end of the plan
+	    j->fd = -1;
+	}
+	return (0);
+    }
+
+    signal(SIGPIPE, SIG_DFL);
+    close(ls);
+    rewind(j->in);
+    dup2(fileno(j->in), 0);
+    if (j->kind == JOB_PLAN) {
+	dup2(j->fd, 1);
+    }
+    for (k = 0; k < NJOB; k++) {
+	if (jobs[k].fd >= 0) {
+	    close(jobs[k].fd);
+	}
+    }
+
+    av[0] = prog;
+    k = 1;
+    for (tok = strtok(args(j), " \t"); tok != NULL; tok = strtok(NULL, " \t")) {
+	if (k > MAXARGS) {
+	    fprintf(stderr, "%s error: job %d has more than %d options\n",
+		prog, j->id, MAXARGS);
+	    exit(1);
+	}
+	av[k++] = tok;
+    }
+    av[k] = NULL;
+    *argc = k;
+    *argv = av;
+    return (j->kind);
+}
+
+// collect finished jobs
+
+static void reap()
+{
+    pid_t pid;
+    int st, k;
+    JOB *j;
+
+    while ((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+	for (k = 0; k < NJOB && jobs[k].pid != pid; k++) {
+	    ;
+	}
+	if (k == NJOB) {
+	    continue;
+	}
+	j = &jobs[k];
+	if (WIFEXITED(st) && WEXITSTATUS(st) == 0) {
+	    ndone++;
+	    reply(j, "done %d ok time %.3f\n", j->id, now() - j->t0);
+	} else {
+	    nfail++;
+	    reply(j, "done %d FAIL status %d\n", j->id,
+		WIFEXITED(st) ? WEXITSTATUS(st) : -WTERMSIG(st));
+	}
+	drop(j);
+    }
+}
+
+// start every plan job that is in and the next run job if the device
+// is free.  Returns the job's kind in its child.
+
+static int dispatch(char *prog, int *argc, char ***argv)
+{
+    JOB *next = NULL, *j;
+    int k, kind;
+
+    for (k = 0; k < NJOB; k++) {
+	j = &jobs[k];
+	if (j->kind == JOB_RUN && j->state == RUNNING) {
+	    next = j;
+	    break;
+	}
+    }
+    for (k = 0; k < NJOB; k++) {
+	j = &jobs[k];
+	if (j->state != QUEUED) {
+	    continue;
+	}
+	if (j->kind == JOB_PLAN) {
+	    if ((kind = start(j, prog, argc, argv)) != 0) {
+		return (kind);
+	    }
+	} else if (next == NULL || (next->state == QUEUED && j->seq < next->seq)) {
+	    next = j;
+	}
+    }
+    if (next != NULL && next->state == QUEUED) {
+	return (start(next, prog, argc, argv));
+    }
+    return (0);
+}
+
+// serve jobs on the Unix socket path.  Only returns in the process
+// of a job, with JOB_RUN or JOB_PLAN.
+
+int serve(char *path, char *prog, int *argc, char ***argv)
+{
+    struct sockaddr_un sa;
+    struct pollfd pfd[NJOB + 1];
+    JOB *pj[NJOB + 1];
+    int np, fd, busy, k;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+	fprintf(stderr, "%s error: socket path %s too long\n", prog, path);
+	exit(1);
+    }
+    strcpy(sa.sun_path, path);
+    unlink(path);
+    if ((ls = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	bind(ls, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(ls, 16) < 0) {
+	fprintf(stderr, "%s error: can't listen on %s\n", prog, path);
+	exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    for (k = 0; k < NJOB; k++) {
+	jobs[k].fd = -1;
+    }
+    tstart = now();
+
+    for (;;) {
+	pfd[0].fd = ls;
+	pfd[0].events = POLLIN;
+	np = 1;
+	busy = 0;
+	for (k = 0; k < NJOB; k++) {
+	    if (jobs[k].state == READING) {
+		pfd[np].fd = jobs[k].fd;
+		pfd[np].events = POLLIN;
+		pj[np++] = &jobs[k];
+	    }
+	    busy |= (jobs[k].state == RUNNING);
+	}
+	if (poll(pfd, np, busy ? WAITMS : -1) < 0 && errno != EINTR) {
+	    fprintf(stderr, "%s error: poll failed\n", prog);
+	    exit(1);
+	}
+	reap();
+
+	for (k = 1; k < np; k++) {
+	    if (pfd[k].revents) {
+		input(pj[k]);
+	    }
+	}
+	if (pfd[0].revents & POLLIN) {
+	    if ((fd = accept(ls, NULL, NULL)) >= 0) {
+		for (k = 0; k < NJOB && jobs[k].state != FREE; k++) {
+		    ;
+		}
+		if (k == NJOB) {
+		    write(fd, "error: busy\n", 12);
+		    close(fd);
+		} else {
+		    jobs[k].state = READING;
+		    jobs[k].fd = fd;
+		    jobs[k].t0 = now();
+		}
+	    }
+	}
+	if ((k = dispatch(prog, argc, argv)) != 0) {
+	    return (k);
+	}
+    }
+}
@@ -0,0 +1,4 @@
+#define JOB_RUN 1		// planned to the daemon's stdout, the device
+#define JOB_PLAN 2		// planned back to the client
+
+extern int serve(char *path, char *prog, int *argc, char ***argv);
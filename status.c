@@ -0,0 +1,78 @@
+#include <stdio.h>
+
+#include "status.h"
+
+//
+// parser for the firmware's status frames:
+//
+//	0xa5 0x5a, then little endian
+//	bytes received (4), rxque0 fill (2), tick queue entries (1),
+//	ticks queued (2), idle ticks (2), x y z w steps run (4 each)
+//	and the low byte of the sum of those 27 bytes
+//
+// Bytes are handed in one at a time as they arrive, anything that
+// isn't part of a frame is skipped.  The parser state is kept in the
+// STATUS, so each link can have its own; a zeroed STATUS is ready.
+//
+
+#define SYNC0 0xa5
+#define SYNC1 0x5a
+
+static unsigned long get(unsigned char *buf, int i, int len)
+{
+    unsigned long v = 0;
+
+    while (len-- > 0) {
+	v = (v << 8) | buf[i + len];
+    }
+    return (v);
+}
+
+// take byte c, returns 1 when it completes a good frame in s
+
+int status_byte(STATUS *s, int c)
+{
+    int i;
+
+    c &= 0xff;
+    if (s->n == 0) {
+	if (c == SYNC0) {
+	    s->n = 1;
+	}
+	return (0);
+    }
+    if (s->n == 1) {
+	s->n = (c == SYNC1) ? 2 : (c == SYNC0) ? 1 : 0;
+	s->sum = 0;
+	return (0);
+    }
+    if (s->n < STATLEN + 2) {
+	s->buf[s->n++ - 2] = c;
+	s->sum += c;
+	return (0);
+    }
+    s->n = 0;
+    if (c != s->sum) {
+	s->bad++;
+	return (0);
+    }
+    s->rxcount = get(s->buf, 0, 4);
+    s->rxfill = get(s->buf, 4, 2);
+    s->entries = s->buf[6];
+    s->ticks = get(s->buf, 7, 2);
+    s->idle = get(s->buf, 9, 2);
+    for (i = 0; i < 4; i++) {
+	s->pos[i] = (int) get(s->buf, 11 + 4 * i, 4);
+    }
+    s->frames++;
+    return (1);
+}
+
+// of sent bytes, those the firmware has taken in since its count was
+// base.  The count wraps at 32 bits but never runs ahead of what was
+// sent, so the low 32 bits of the gap are all there is to it.
+
+unsigned long status_taken(STATUS *s, unsigned long base, unsigned long sent)
+{
+    return (sent - ((sent + base - s->rxcount) & RXMASK));
+}
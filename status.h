@@ -0,0 +1,22 @@
+// status frames sent back by the firmware (see pic/servo4.c)
+
+#define STATLEN 27		// bytes between the sync and the checksum
+#define RXMASK 0xffffffffUL	// rxcount is 32 bits and wraps
+
+typedef struct status {
+    unsigned long rxcount;	// bytes the firmware has taken in
+    unsigned int rxfill;	// bytes waiting in its receive queue
+    int entries;		// tick queue entries
+    int ticks;			// ticks of motion queued
+    unsigned int idle;		// ticks it had nothing to output (wraps)
+    long pos[4];		// steps run, x y z w
+    long frames;		// good frames seen
+    long bad;			// frames dropped on a bad checksum
+    int n;			// sync and frame bytes so far
+    unsigned char buf[STATLEN];	// the frame
+    unsigned char sum;
+} STATUS;
+
+extern int status_byte(STATUS *s, int c);
+extern unsigned long status_taken(STATUS *s, unsigned long base,
+				  unsigned long sent);
@@ -7,38 +7,43 @@ void fatal(char *s) {
     fprintf(stderr, "%s\n", s);
     exit(1);
 }
-// configure a STEPPARM structure based on the following parameters
+// configure a caller owned STEPPARM structure based on the following
+// parameters
 //
 //	L 	; length of stroke
 //	vs	; starting speed (non-zero if chaining, usually zero)
 // 	ve	; ending speed (non-zero if chaining, usually zero)
 //	vmax	; maximum allowed speed
 // 	amax	; maximum acceleration
+// 	jmax	; maximum jerk (0 for a trapezoid)
 //	res	; size of a step
 //
 
-STEPPARM *stepper_set_parms(float l, float vs, float ve, float amax, float vmax, float res) {
-    STEPPARM *s=NULL;
-    float vm;
+// point p at the fields of s as a one entry profile.  It isn't kept
+// in s, which would point into the original after s is copied.
 
-    if ((s=(STEPPARM *)malloc(sizeof(STEPPARM))) == NULL) {
-	return NULL;
-    }
+void stepper_profile(STEPPARM *s, PROFILE *p) {
+    p->n = 1;
+    p->l = &s->l; p->vs = &s->vs; p->ve = &s->ve;
+    p->vmax = &s->vmax; p->amax = &s->amax;
+    p->vm = &s->vm; p->s1 = &s->s1; p->s2 = &s->s2; p->s3 = &s->s3;
+    p->ts1 = &s->ts1; p->ts2 = &s->ts2; p->t = &s->t;
+    p->jmax = &s->jmax;
+}
+
+void stepper_set_parms(STEPPARM *s, float l, float vs, float ve, float amax, float vmax, float jmax, float res) {
+    PROFILE p;
 
     s->l = l;
     s->vs = vs;
     s->ve = ve;
     s->vmax = vmax;
     s->amax = amax;
+    s->jmax = jmax;
     s->res = res;
-    s->vm = vm = fminf(sqrtf((vs*vs+ve*ve+2.0*amax*l)/2.0),vmax);
-    s->s1=(vm*vm-vs*vs)/(2.0*amax); if (fabsf(s->s1)<res) s->s1 = 0.0;
-    s->s3=(vm*vm-ve*ve)/(2.0*amax); if (fabsf(s->s3)<res) s->s3 = 0.0;
-    s->s2=(l - s->s1 - s->s3); if (fabsf(s->s2)<res) s->s2 = 0;
-    s->ts1 = (sqrtf(vs*vs+2.0*amax* s->s1)-vs)/amax;  	// time to reach s1
-    s->ts2 = s->ts1 + (s->s2)/vm;                   	// time to reach s2
-
-    return s;
+
+    stepper_profile(s, &p);
+    profile_solve(&p, res);
 }
 
 void setpen(int pen) {
@@ -48,27 +53,38 @@ void setpen(int pen) {
 // return the time to get to distance L
 
 float time_at_l(STEPPARM *s, float l) {
-
-    float tt=0.0;
+    PROFILE p;
+    int pen;
+    float tt;
 
     if (s==NULL) fatal("null stepparm in time_at_l()");
 
-    if (l < s->s1) {             // accellerating
-       tt = (sqrtf(s->vs*s->vs+2.0*s->amax*l)-s->vs)/s->amax;
-       setpen(2);
-    } else if (l < s->s1+s->s2) {   // cruising
-       tt = s->ts1 + (l-s->s1)/s->vm;
-       setpen(3);
-    } else {                  // decellerating
-       tt = s->ts2 + (s->vm - sqrtf(fabsf(s->vm*s->vm - 2.0*s->amax*(l-(s->s2+s->s1)))))/s->amax;
-       setpen(4);
-    }
+    stepper_profile(s, &p);
+    tt = profile_time(&p, 0, l, &pen);
+    setpen(pen);
     return(tt);
 }
 
+// return the speed at distance L of a trapezoid (jmax 0)
+
+float speed_at_l(STEPPARM *s, float l) {
+    float v2;
+
+    if (s==NULL) fatal("null stepparm in speed_at_l()");
+
+    if (l < s->s1) {
+	v2 = s->vs*s->vs + 2.0*s->amax*l;
+    } else if (l < s->s1 + s->s2) {
+	v2 = s->vm*s->vm;
+    } else {
+	v2 = s->vm*s->vm - 2.0*s->amax*(l - s->s1 - s->s2);
+    }
+    return(v2 > 0.0 ? sqrt(v2) : 0.0);
+}
+
 int test_main(void) {
     float ll;
-    STEPPARM *s=NULL;
+    STEPPARM sp, *s=&sp;
 
     float l=200.0;
     float res=1.0;
@@ -76,11 +92,9 @@ int test_main(void) {
     float t0=0.0;
     float t1=0.0;
 
-    // stepper_set_parms(float l, float vs, float ve, float vmax, float amax, float res) {
+    // stepper_set_parms(STEPPARM *s, float l, float vs, float ve, float amax, float vmax, float jmax, float res) {
 
-    if ((s=stepper_set_parms(l, 0.0, 0.0, 1.0, 10.0, res)) == NULL) {
-	fatal("STEPPARM malloc error");
-    }
+    stepper_set_parms(s, l, 0.0, 0.0, 1.0, 10.0, 0.0, res);
 
     while(1) {
 	for (ll=0; ll<=l; ll+=res) {
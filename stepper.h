@@ -1,18 +1,24 @@
+#include "profile.h"
+
 typedef struct stepparm {
-    float l;
-    float vs;	// starting speed (non-zero if chaining, usually zero)
-    float ve;   // ending speed (non-zero if chaining, usually zero)
-    float vmax; // maximum speed
-    float amax;  // maximum acceleration
-    float res;	// size of a step
-    float s1;	// distance from start to reach vmax
-    float s2;	// distance for cruising at vmax
-    float s3;	// distance from end of cruising to stop point
-    float ts1;	// time to reach s1
-    float ts2;	// time to reach s2
-    float vm;	
+    double l;
+    double vs;	// starting speed (non-zero if chaining, usually zero)
+    double ve;   // ending speed (non-zero if chaining, usually zero)
+    double vmax; // maximum speed
+    double amax;  // maximum acceleration
+    double jmax;  // maximum jerk, 0 for a trapezoid
+    double res;	// size of a step
+    double s1;	// distance from start to reach vmax
+    double s2;	// distance for cruising at vmax
+    double s3;	// distance from end of cruising to stop point
+    double ts1;	// time to reach s1
+    double ts2;	// time to reach s2
+    double t;	// time to reach l
+    double vm;	
 } STEPPARM;
 
-STEPPARM *stepper_set_parms(float l, float vs, float ve, float amax, float vmax, float res);
+void stepper_profile(STEPPARM *s, PROFILE *p);
+void stepper_set_parms(STEPPARM *s, float l, float vs, float ve, float amax, float vmax, float jmax, float res);
 float time_at_l(STEPPARM *s, float l);
+float speed_at_l(STEPPARM *s, float l);
 void fatal(char *msg);
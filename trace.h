@@ -0,0 +1,29 @@
+// binary motion trace, written by velo -T and read by vtrace.
+// Records are in host byte order, after a header of
+//
+//	"VTR1", then doubles fstep, xres, yres, zres, wres
+//
+// each segment of the plan is
+//
+//	'S', then a TRACESEG
+//
+// and with velo -t each step is
+//
+//	'P', the step mask (1 byte), the firmware tick (uint32)
+
+#define TRACE_MAGIC "VTR1"
+#define TRACE_SEG 'S'
+#define TRACE_STEP 'P'
+
+typedef struct traceseg {
+    int line;		// input line of the end point
+    unsigned int tick;	// firmware tick at the start
+    double t0;		// planned time at the start
+    float l;		// length
+    float vlim;		// speed limit
+    float amax;		// acceleration limit
+    float vs, vm, ve;	// start, peak and end speed
+    float s1, s2, s3;	// ramp up, cruise and ramp down distance
+    float ts1, ts2;	// end of ramp up and of cruise, from t0
+    float t;		// segment time
+} TRACESEG;
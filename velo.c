@@ -2,8 +2,19 @@
 #include <stdlib.h>
 #include <math.h>
 #include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
 
 #include "interpolate.h"
+#include "corner.h"
+#include "machine.h"
+#include "profile.h"
+#include "bytecodes.h"
+#include "dda.h"
+#include "cache.h"
+#include "trace.h"
+#include "serve.h"
 
 //
 // based on "An optimal feedrate model and solution algorithm for
@@ -22,9 +33,16 @@ typedef struct node {
     double w;			// w value for start of this segment
     double vs;			// velocity at start of this segment
     double l;			// distance to the next segment
-    int eof;			// marker for missing data
+    double r;			// blend arc radius at this node (0=corner)
+    double vm;			// velocity limit to the next segment
+    double am;			// acceleration limit to the next segment
+    int line;			// input line of this point
+    int eof;			// 1 = missing data, 2 = pad (stop) in stream mode
 } NODE;
 
+// bump whenever the planner output changes, it keys the plan cache
+#define VERSION "velo 3"
+
 #define MAXLOOK 64		// maximum lookahead
 #define MAXBUF 128		// maximum input x,y,z,w linesize
 
@@ -39,9 +57,16 @@ typedef struct node {
 int nlook = NLOOK;
 double amax = AMAX;
 double vmax = VMAX;
+double jmax = 0.0;		// jerk limit, 0 for trapezoid ramps
 double res = RES;
 double fstep = FSTEP;
-int mode = 0;
+int umode = 0;
+int interp = 1;			// microsteps/step of umode
+double budget = 0.0;		// link bytes/second, adapt microsteps if > 0
+int sk = 1;			// microsteps per step now
+int idda = 0;			// use the integer step engine
+char *mfile = NULL;		// machine profile
+int latency = -1;		// stream mode input wait (ms), -1 = off
 
 
 int debug = 0;
@@ -52,101 +77,620 @@ NODE *pnodebuf = nodebuf;
 char buf[MAXBUF];
 int readerrors = 0;
 int nread = 0;
+int nline = 0;			// input lines read
+int pline = 0;			// input line of the last point from nextpoint()
+int blline = 0;			// last input line pushed into the blending stage
+char *xname = NULL;		// resume index file
+FILE *xfile = NULL;
+char *cdir = NULL;		// plan cache directory
+char *dname = NULL;		// daemon socket
+FILE *ctee = NULL;		// new cache entry
+FILE *fin;			// path input
+unsigned long long cdkey;	// key of the new cache entry
+int estimate = 0;		// only plan, report the job time
+char *tname = NULL;		// motion trace file
+FILE *tfile = NULL;
+int tsteps = 0;			// trace every step too
+
+#define NSLOW 5			// slowest segments to report
+
+double tacc, tcru, tdec;	// time accelerating, cruising, decelerating
+int slowline[NSLOW];		// input line at the end of the segment
+double slowlost[NSLOW];		// time lost against the speed limit
+double slowlen[NSLOW];
+double slowtime[NSLOW];
+
+#define EBATCH 256		// segments solved at once
+
+double el[EBATCH], evs[EBATCH], eve[EBATCH], evmax[EBATCH], eamax[EBATCH];
+double ejmax[EBATCH], evm[EBATCH], es1[EBATCH], es2[EBATCH], es3[EBATCH];
+double ets1[EBATCH], ets2[EBATCH], et[EBATCH];
+int eline[EBATCH];		// input line at the end of each
+double evlim[EBATCH];		// speed limit of each
+PROFILE ebatch = {		// the segments queued by -e
+    0, el, evs, eve, evmax, eamax, evm, es1, es2, es3, ets1, ets2, et, ejmax
+};
 int n = 0;
+int npts = 0;
 
 NODE *d(int k)		// modulo access point data ring buffer 
 {
     return (&nodebuf[(n + k + nlook) % nlook]);
 }
 
-int getval()	// read either "x y" or "x y z" or "x y z w" from stdin
+// stream mode line reader.  stdio can't say whether a line is
+// waiting without blocking, so read(2) stdin into our own buffer and
+// poll(2) it with a deadline of ms milliseconds (-1 = forever).
+// Returns 1 for a line, 0 at end of file and 2 if the time ran out.
+
+char ibuf[4 * MAXBUF];
+int ilen = 0;
+int ieof = 0;
+
+int streamline(char *s, int size, int ms)
 {
-    int c;
-    double x, y, z, w;
-    n = (n + 1) % nlook;
-    nodebuf[n].eof = 0;
-    if (fgets(buf, MAXBUF, stdin) == NULL) {
-	nodebuf[n].x = 0.0;
-	nodebuf[n].y = 0.0;
-	nodebuf[n].z = 0.0;
-	nodebuf[n].w = 0.0;
-	nodebuf[n].vs = 0.0;
-	nodebuf[n].l = 0.0;
-	nodebuf[n].eof = 1;
-    } else if (sscanf(buf, "%lf %lf %lf %lf", &x, &y, &z, &w) == 4) {
-	nodebuf[n].x = x;
-	nodebuf[n].y = y;
-	nodebuf[n].z = z;
-	nodebuf[n].w = w;
-	nodebuf[n].vs = 0.0;
-	nodebuf[n].l = 0.0;
-	nread++;
-    } else if (sscanf(buf, "%lf %lf %lf", &x, &y, &z) == 3) {
-	nodebuf[n].x = x;
-	nodebuf[n].y = y;
-	nodebuf[n].z = z;
-	nodebuf[n].w = 0.0;
-	nodebuf[n].vs = 0.0;
-	nodebuf[n].l = 0.0;
-	nread++;
-    } else if (sscanf(buf, "%lf %lf", &x, &y) == 2) {
-	nodebuf[n].x = x;
-	nodebuf[n].y = y;
-	nodebuf[n].z = 0.0;
-	nodebuf[n].w = 0.0;
-	nodebuf[n].vs = 0.0;
-	nodebuf[n].l = 0.0;
-	nread++;
-    } else {
+    struct pollfd pfd;
+    struct timespec t0, t1;
+    char *e;
+    int k, wait;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (;;) {
+	e = memchr(ibuf, '\n', ilen);
+	if (e != NULL || ilen >= size - 1 || (ieof && ilen > 0)) {
+	    k = (e != NULL) ? e - ibuf + 1 : ilen;
+	    if (k > size - 1) {
+		k = size - 1;
+	    }
+	    memcpy(s, ibuf, k);
+	    s[k] = '\0';
+	    memmove(ibuf, ibuf + k, ilen - k);
+	    ilen -= k;
+	    return (1);
+	}
+	if (ieof) {
+	    return (0);
+	}
+
+	// whatever is planned so far goes out before we wait
+
+	fflush(stdout);
+	wait = ms;
+	if (ms > 0) {
+	    clock_gettime(CLOCK_MONOTONIC, &t1);
+	    wait = ms - ((t1.tv_sec - t0.tv_sec) * 1000 +
+			 (t1.tv_nsec - t0.tv_nsec) / 1000000);
+	    if (wait < 0) {
+		wait = 0;
+	    }
+	}
+	pfd.fd = 0;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, wait) == 0) {
+	    return (2);
+	}
+	if ((k = read(0, ibuf + ilen, sizeof(ibuf) - ilen)) <= 0) {
+	    ieof++;
+	} else {
+	    ilen += k;
+	}
+    }
+}
+
+// read either "x y" or "x y z" or "x y z w" from stdin into p[],
+// returns 1 for a point, 0 at end of file and -1 for a bad line.
+// In stream mode wait at most ms milliseconds and return 2 if no
+// line came in.
+
+int readpoint(double *p, int ms)
+{
+    char *s, *e;
+    int c, k;
+
+    if (latency < 0) {
+	if (fgets(buf, MAXBUF, fin) == NULL) {
+	    return (0);
+	}
+    } else if ((c = streamline(buf, MAXBUF, ms)) != 1) {
+	return (c);
+    }
+    nline++;
+    // strtod in one pass, sscanf retried per field count is most of
+    // the cost of an estimate (-e)
+
+    p[0] = p[1] = p[2] = p[3] = 0.0;
+    for (s = buf, k = 0; k < 4; k++, s = e) {
+	p[k] = strtod(s, &e);
+	if (e == s) {
+	    p[k] = 0.0;
+	    break;
+	}
+    }
+    if (k < 2) {
 	readerrors++;
 	fprintf(stderr, "error: on line %d, \"%s\"\n", nread, buf);
+	return (-1);
     }
+    nread++;
+    return (1);
+}
 
-    // fprintf(stderr,"x:%g y:%g z:%g w:%g \n", nodebuf[n].x, 
-    // nodebuf[n].y, nodebuf[n].z, nodebuf[n].w);
+// set length and velocity/acceleration limits of the segment a->b
+// from the projection of the segment on each machine axis
 
-    if (nread > 1) {
+void seglimits(NODE *a, NODE *b)
+{
+    double u[NAXIS];
+    int k;
+
+    u[0] = b->x - a->x;
+    u[1] = b->y - a->y;
+    u[2] = b->z - a->z;
+    u[3] = b->w - a->w;
+    a->l = sqrt(pow(u[0], 2.0) + pow(u[1], 2.0) +
+		pow(u[2], 2.0) + pow(u[3], 2.0));
+    a->vm = vmax;
+    a->am = amax;
+    if (a->l > 0.0) {
+	for (k = 0; k < NAXIS; k++) {
+	    u[k] /= a->l;
+	}
+	machine_limits(u, &a->vm, &a->am);
+    }
+}
 
-        d(0)->x *= -1.0;	// correct direction for cnc3040
+// get the next path point, either straight from the input or
+// through the corner blending stage.  Returns 1 for a point, 0 at
+// end of file and 2 if nothing came in within ms milliseconds.
+// Blended points are credited to the input line of their corner,
+// which the stage releases when the line after it is pushed in.
 
-	d(-1)->l = sqrt(pow((d(0)->x - d(-1)->x), 2.0) +
-			pow((d(0)->y - d(-1)->y), 2.0) +
-			pow((d(0)->z - d(-1)->z), 2.0) +
-			pow((d(0)->w - d(-1)->w), 2.0) );
+int nextpoint(double *p, double *r, int ms)
+{
+    int c;
+
+    *r = 0.0;
+    if (btol > 0.0) {
+	while (!blend_get(p, r)) {
+	    if ((c = readpoint(p, ms)) == 0) {
+		pline = blline;
+		blline = 0;
+		blend_flush();
+		if (!blend_get(p, r)) {
+		    return (0);
+		}
+		break;
+	    } else if (c == 2) {
+		// the input paused, release the held corner point
+		pline = blline;
+		blline = 0;
+		blend_flush();
+		return (blend_get(p, r) ? 1 : 2);
+	    } else if (c > 0) {
+		pline = blline ? blline : nline;
+		blline = nline;
+		blend_put(p);
+	    }
+	}
+    } else {
+	while ((c = readpoint(p, ms)) < 0) {
+	    ;
+	}
+	pline = nline;
+	return (c);
     }
-    return (readerrors);
+    return (1);
 }
 
+// look the whole input and every setting that shapes the plan up in
+// the cache.  Streams the cached plan and exits on a hit, otherwise
+// plans from the saved input and keeps a copy of the output.
 
-int main(int argc, char **argv)
+void cachedplan(char *prog)
 {
-    int done = 0;
+    static char *in = NULL;
+    long nin = 0, size = 0, k;
+    unsigned long long key = 0;
+    char parm[512];
+
+    for (;;) {
+	if (nin == size) {
+	    size = size ? 2 * size : 65536;
+	    if ((in = realloc(in, size)) == NULL) {
+		fprintf(stderr, "%s error: out of memory for the input\n", prog);
+		exit(1);
+	    }
+	}
+	if ((k = fread(in + nin, 1, size - nin, stdin)) <= 0) {
+	    break;
+	}
+	nin += k;
+    }
+
+    snprintf(parm, sizeof(parm), 
+	"%s %s %s a%.17g v%.17g n%d r%.17g f%.17g s%d u%.17g b%.17g j%.17g J%.17g i%d x%d",
+	VERSION, __DATE__, __TIME__, amax, vmax, nlook, res, fstep, umode, 
+	budget, btol, jdev, jmax, idda, xname != NULL);
+    cache_hash(&key, parm, strlen(parm));
+    if (mfile != NULL) {
+	cache_hashfile(&key, mfile);
+    }
+    cache_hash(&key, in, nin);
+
+    if (cache_get(cdir, key, xname)) {
+	exit(0);
+    }
+    if (nin > 0 && (fin = fmemopen(in, nin, "r")) == NULL) {
+	fprintf(stderr, "%s error: can't reread the input\n", prog);
+	exit(1);
+    }
+    if ((ctee = cache_put(cdir, key)) != NULL) {
+	bc_tee(ctee);
+    } else if (debug&32) {
+	fprintf(stderr, "can't write to cache %s\n", cdir);
+    }
+    cdkey = key;
+}
+
+// write the trace record of segment i of p about to be stepped, which
+// starts at time t0 and ends at input line
+
+void traceseg(PROFILE *p, int i, int line, double t0)
+{
+    TRACESEG r;
+
+    r.line = line;
+    r.tick = bc_ticks();
+    r.t0 = t0;
+    r.l = p->l[i];
+    r.vlim = p->vmax[i];
+    r.amax = p->amax[i];
+    r.vs = p->vs[i];
+    r.vm = p->vm[i];
+    r.ve = p->ve[i];
+    r.s1 = p->s1[i];
+    r.s2 = p->s2[i];
+    r.s3 = p->s3[i];
+    r.ts1 = p->ts1[i];
+    r.ts2 = p->ts2[i];
+    r.t = p->t[i];
+    putc(TRACE_SEG, tfile);
+    fwrite(&r, sizeof(r), 1, tfile);
+}
+
+// estimate mode: tally the time split of segment i of p, ending at
+// input line, and keep the NSLOW segments that fall furthest behind
+// their speed limit vm
+
+void tally(PROFILE *p, int i, int line, double vm)
+{
+    double lost;
+    int k;
+
+    tacc += p->ts1[i];
+    tcru += p->ts2[i] - p->ts1[i];
+    tdec += p->t[i] - p->ts2[i];
+
+    lost = p->t[i] - p->l[i] / vm;
+    for (k = NSLOW; k > 0 && (slowline[k - 1] == 0 || lost > slowlost[k - 1]); k--) {
+	if (k < NSLOW) {
+	    slowline[k] = slowline[k - 1];
+	    slowlost[k] = slowlost[k - 1];
+	    slowlen[k] = slowlen[k - 1];
+	    slowtime[k] = slowtime[k - 1];
+	}
+    }
+    if (k < NSLOW) {
+	slowline[k] = line;
+	slowlost[k] = lost;
+	slowlen[k] = p->l[i];
+	slowtime[k] = p->t[i];
+    }
+}
+
+// estimate mode plans nothing to step, so a segment is only queued
+// here once it is at the front of the window, where it is final, and
+// the queue is solved EBATCH at a time.  Then xloc..wloc step to its
+// end b as if it had been stepped.
+
+void equeue(NODE *a, NODE *b)
+{
+    int n = ebatch.n++;
+
+    el[n] = a->l;
+    evs[n] = a->vs;
+    eve[n] = b->vs;
+    evmax[n] = a->vm;
+    eamax[n] = a->am;
+    ejmax[n] = jmax;
+    eline[n] = b->line;
+    evlim[n] = a->vm;
+
+    xloc = (int)round(b->x/xres);
+    yloc = (int)round(b->y/yres);
+    zloc = (int)round(b->z/zres);
+    wloc = (int)round(b->w/wres);
+}
+
+// solve the queue and tally it, from time t0.  Returns its time.
+
+double eflush(double rmin, double t0)
+{
+    double t = 0.0;
     int i;
-    double x0, y0, z0, w0;
-    double x1, y1, z1, w1;
-    double x2, y2, z2, w2;
-    double cosine;
-    double vv;
-    double ltotal = 0.0;
-    double ttotal = 0.0;
-    double len;
 
-    extern int optind;
+    profile_solve(&ebatch, rmin);
+    for (i = 0; i < ebatch.n; i++) {
+	if (tfile != NULL) {
+	    traceseg(&ebatch, i, eline[i], t0 + t);
+	}
+	t += et[i];
+	tally(&ebatch, i, eline[i], evlim[i]);
+    }
+    ebatch.n = 0;
+    return (t);
+}
+
+// adaptive microstepping: the smallest step scale k (in microsteps,
+// a power of two up to interp) that keeps steps MINSTEP updates apart
+// and, at about two bytes a step, within the link byte budget at v
+
+int stepscale(double v, double rmin)
+{
+    int k;
+
+    for (k = 1; k < interp; k *= 2) {
+	if (fstep * rmin * k / v >= MINSTEP && 2.0 * v / (rmin * k) <= budget) {
+	    break;
+	}
+    }
+    return (k);
+}
+
+// is every axis of a position (in microsteps) a whole number of k?
+
+int aligned(int k, int x, int y, int z, int w)
+{
+    return (((x | y | z | w) & (k - 1)) == 0);
+}
+
+// pick the scale for the move to b (at peak speed v, c follows b).
+// A coarse step is only taken from a position that is a whole number
+// of coarse steps, so b is rounded onto the grid of the coarser of
+// this and the next segment.  A move that ends in a stop is rounded
+// onto its own grid too, and the exact end kept in tail[] to be
+// nudged to in fine steps once stopped, so the job ends exactly where
+// the path does without stepping fine at speed.  Returns the scale.
+
+double tail[NAXIS];		// exact end of a stop
+
+int stepmode(double v, NODE *b, NODE *c, double rmin)
+{
+    int k, kn;
+
+    k = kn = stepscale(v, rmin);
+    if (c->eof && k == 1) {
+	return (k);
+    } else if (c->eof) {
+	tail[0] = b->x; tail[1] = b->y; tail[2] = b->z; tail[3] = b->w;
+    } else if ((kn = stepscale(b->vm, rmin)) < k) {
+	kn = k;
+    }
+    b->x = round(b->x / (xres * kn)) * kn * xres;
+    b->y = round(b->y / (yres * kn)) * kn * yres;
+    b->z = round(b->z / (zres * kn)) * kn * zres;
+    b->w = round(b->w / (wres * kn)) * kn * wres;
+    return (k);
+}
+
+// emit the MODE change for scale k
+
+void setscale(int k)
+{
+    if (k != sk) {
+	if (debug&4) {
+	    fprintf(stderr,"MODE %.2x\n", interp2mode(interp / k));
+	} else {
+	    mode(interp2mode(interp / k));
+	}
+	sk = k;
+    }
+}
+
+// a rest to rest move of less than a coarse step to x,y,z,w, in
+// single microsteps and slow enough for them.  Returns its time.
+
+double nudge(double x, double y, double z, double w, double rmin)
+{
+    double l = sqrt(pow(x - xloc * xres, 2.0) + pow(y - yloc * yres, 2.0) +
+		    pow(z - zloc * zres, 2.0) + pow(w - wloc * wres, 2.0));
+
+    if (l < rmin / 2.0) {
+	return (0.0);
+    }
+    setscale(1);
+    setseg(l, 0.0, 0.0, min(vmax, fstep * rmin / MINSTEP), amax, jmax, rmin, fstep);
+    if (idda) {
+	return (dda(segprofile(), (int)round(x/xres), (int)round(y/yres),
+		    (int)round(z/zres), (int)round(w/wres), fstep));
+    }
+    return (interpolate((double)xloc*xres, (double)yloc*yres, (double)zloc*zres,
+			(double)wloc*wres, x, y, z, w, 0.0, 0.0));
+}
+
+// step the engines in units of k microsteps, and back
+
+void rescale(int k)
+{
+    xres *= k; yres *= k; zres *= k; wres *= k;
+    xloc /= k; yloc /= k; zloc /= k; wloc /= k;
+}
+
+void unscale(int k)
+{
+    xres /= k; yres /= k; zres /= k; wres /= k;
+    xloc *= k; yloc *= k; zloc *= k; wloc *= k;
+}
+
+// fill in node a from the input point p
+
+void setnode(NODE *a, double *p, double r, int eof)
+{
+    a->eof = eof;
+    a->vs = 0.0;
+    a->l = 0.0;
+    a->r = 0.0;
+    a->line = 0;
+    if (eof == 1) {
+	a->x = 0.0;
+	a->y = 0.0;
+	a->z = 0.0;
+	a->w = 0.0;
+    } else {
+	a->x = p[0];
+	a->y = p[1];
+	a->z = p[2];
+	a->w = p[3];
+	a->r = r;
+	a->line = pline;
+	if (axis[0].invert) a->x *= -1.0;
+	if (axis[1].invert) a->y *= -1.0;
+	if (axis[2].invert) a->z *= -1.0;
+	if (axis[3].invert) a->w *= -1.0;
+	npts++;
+    }
+}
+
+// turn node a into a pad, a zero length stop at the point of node b
+
+void setpad(NODE *a, NODE *b)
+{
+    *a = *b;
+    a->eof = 2;
+    a->vs = 0.0;
+    a->l = 0.0;
+    a->r = 0.0;
+    a->vm = vmax;
+    a->am = amax;
+}
+
+// stream mode: the new ring slot starts out as a pad, so the planner
+// stops at the last point it has.  Points that come in replace the
+// oldest pads still ahead of the current move, which lets motion
+// carry on through them.  Block only when there is nothing to move.
+
+int getstream()
+{
+    double p[NAXIS];
+    double r;
+    int c, k, j, ms;
+
+    n = (n + 1) % nlook;
+    if (d(-1)->eof == 1) {
+	setnode(d(0), p, 0.0, 1);
+	return (readerrors);
+    }
+    setpad(d(0), d(-1));
+
+    ms = latency;
+    if (npts == 0 || d(2)->eof == 2) {
+	ms = -1;
+    }
+    while ((c = nextpoint(p, &r, ms)) == 1) {
+	for (k = 2; k < nlook && d(k)->eof != 2; k++) {
+	    ;
+	}
+	setnode(d(k), p, r, 0);
+	for (j = k + 1; j <= nlook; j++) {
+	    setpad(d(j), d(k));
+	}
+	if (npts > 1) {
+	    seglimits(d(k - 1), d(k));
+	}
+	if (k == nlook) {		// window is full
+	    break;
+	}
+	ms = 0;
+    }
+    if (c == 0 && d(0)->eof == 2) {
+	setnode(d(0), p, 0.0, 1);
+    }
+    return (readerrors);
+}
+
+// append the next path point to the ring
+
+int getval()
+{
+    double p[NAXIS];
+    double r;
+    int eof;
+
+    if (latency >= 0) {
+	return (getstream());
+    }
+
+    eof = (nextpoint(p, &r, -1) == 0);
+    n = (n + 1) % nlook;
+    setnode(d(0), p, r, eof);
+
+    // fprintf(stderr,"x:%g y:%g z:%g w:%g \n", nodebuf[n].x, 
+    // nodebuf[n].y, nodebuf[n].z, nodebuf[n].w);
+
+    if (npts > 1) {
+	seglimits(d(-1), d(0));
+    }
+    return (readerrors);
+}
+
+
+// parse the options, returns the number of bad ones
+
+int options(int argc, char **argv)
+{
     extern char *optarg;
     int errflg = 0;
     int c;
 
-    while ((c = getopt(argc, argv, "a:d:f:n:r:s:v:")) != EOF) {
+    while ((c = getopt(argc, argv, "a:b:C:d:D:ef:ij:J:l:m:n:r:s:tT:u:v:x:")) != EOF) {
 	switch (c) {
 	case 'a':			// set acceleration limit
 	    amax = atof(optarg);
 	    break;
+	case 'b':			// set corner blending tolerance
+	    btol = atof(optarg);
+	    break;
+	case 'C':			// plan cache directory
+	    cdir = optarg;
+	    break;
 	case 'd':
 	    debug = atof(optarg);
 	    break;
+	case 'D':			// serve jobs on a Unix socket
+	    dname = optarg;
+	    break;
+	case 'e':			// estimate the job time only
+	    estimate = 1;
+	    break;
 	case 'f':			// set stepper update freq
 	    fstep = atof(optarg);
 	    break;
+	case 'i':			// integer step engine
+	    idda = 1;
+	    break;
+	case 'j':			// use junction deviation corners
+	    jdev = atof(optarg);
+	    break;
+	case 'J':			// jerk limited S-curve ramps
+	    jmax = atof(optarg);
+	    break;
+	case 'l':			// stream with a latency budget
+	    latency = atoi(optarg);
+	    if (latency < 0) latency = 0;
+	    break;
+	case 'm':			// per-axis machine profile
+	    mfile = optarg;
+	    break;
 	case 'n':			// set lookahead
 	    nlook = atoi(optarg);
 	    if (nlook < 3) nlook=3;
@@ -162,22 +706,22 @@ int main(int argc, char **argv)
 	    // L   H   L    // quarter step
 	    // L   H   H    // eighth step
 	    // H   H   H    // sixteenth
-	    mode = atoi(optarg);
-	    switch (mode) {
+	    umode = interp = atoi(optarg);
+	    switch (umode) {
 	        case 1:
-		   mode=0;	// single step
+		   umode=0;	// single step
 		   break;
 		case 2:
-		   mode=1;	// half step
+		   umode=1;	// half step
 		   break;
 		case 4:
-		   mode=2;	// quad step
+		   umode=2;	// quad step
 		   break;
 		case 8:
-		   mode=3;	// eighth step
+		   umode=3;	// eighth step
 		   break;
 		case 16:
-		   mode=7;	// eighth step
+		   umode=7;	// eighth step
 		   break;
 		default:
 		   fprintf(stderr, "%s error: -s <mode> is one of 1,2,4,8 or 16\n", argv[0]);
@@ -185,62 +729,224 @@ int main(int argc, char **argv)
 		   break;
 		}
 	    break;
+	case 't':			// trace every step
+	    tsteps = 1;
+	    break;
+	case 'T':			// write a motion trace
+	    tname = optarg;
+	    break;
+	case 'u':			// adapt microsteps to a link budget
+	    budget = atof(optarg);
+	    break;
 	case 'v':			// set velocity limit
 	    vmax = atof(optarg);
 	    break;
+	case 'x':			// write a resume index
+	    xname = optarg;
+	    break;
 	default:
 	    errflg = 1;
 	    break;
 	}
     }
 
-    if (errflg) {
-	fprintf(stderr, "usage: %s [options] < xyzwfile\n", argv[0]);
-	fprintf(stderr, "     -a <amax>  ; set acceleration limit\n");
-	fprintf(stderr, "     -d <debug> ; verbose debugging bitmask\n");
-	fprintf(stderr, "     -f <fstep> ; stepper update frequency\n");
-	fprintf(stderr, "     -n <nlook> ; set lookahead length \n");
-	fprintf(stderr, "     -r <res>   ; set stepper resolution\n");
-	fprintf(stderr, "     -s <m>     ; set number of microsteps/step: 1,2,4,8,16\n");
-	fprintf(stderr, "     -v <vmax>  ; set velocity limit\n");
+
+    if (jmax > 0.0 && idda) {
+	fprintf(stderr, "%s error: the integer step engine can't limit jerk\n", argv[0]);
+	errflg++;
+    }
+
+    if (dname != NULL && latency >= 0) {
+	fprintf(stderr, "%s error: the daemon can't stream (-l)\n", argv[0]);
+	errflg++;
+    }
+    return (errflg);
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [options] < xyzwfile\n", prog);
+    fprintf(stderr, "     -a <amax>  ; set acceleration limit\n");
+    fprintf(stderr, "     -b <btol>  ; blend corners within tolerance\n");
+    fprintf(stderr, "     -C <dir>   ; cache plans in dir\n");
+    fprintf(stderr, "     -D <path>  ; serve jobs on a Unix socket\n");
+    fprintf(stderr, "     -d <debug> ; verbose debugging bitmask\n");
+    fprintf(stderr, "     -e         ; only estimate the job time, no output\n");
+    fprintf(stderr, "     -f <fstep> ; stepper update frequency\n");
+    fprintf(stderr, "     -i         ; use the integer step engine\n");
+    fprintf(stderr, "     -j <jdev>  ; junction deviation corner model\n");
+    fprintf(stderr, "     -J <jmax>  ; limit jerk, S-curve ramps (not with -i)\n");
+    fprintf(stderr, "     -l <ms>    ; stream, stop if input pauses for ms\n");
+    fprintf(stderr, "     -m <file>  ; per-axis machine profile\n");
+    fprintf(stderr, "     -n <nlook> ; set lookahead length \n");
+    fprintf(stderr, "     -r <res>   ; set stepper resolution\n");
+    fprintf(stderr, "     -s <m>     ; set number of microsteps/step: 1,2,4,8,16\n");
+    fprintf(stderr, "     -t         ; put every step in the trace\n");
+    fprintf(stderr, "     -T <file>  ; write a binary motion trace (see vtrace)\n");
+    fprintf(stderr, "     -u <bytes/s> ; adapt microsteps (up to -s) to the link\n");
+    fprintf(stderr, "     -v <vmax>  ; set velocity limit\n");
+    fprintf(stderr, "     -x <file>  ; write a resume index for feed\n");
+    exit(1);
+}
+
+// set up the machine and check the limits, returns the finest step
+
+double setup(char *prog)
+{
+    double rmin, vv;
+    int i;
+
+    machine_init(vmax, amax, res);
+    if (mfile != NULL && machine_load(mfile) < 0) {
 	exit(1);
     }
+    rmin = machine_res();
 
     if (debug&1) {
     fprintf(stderr, "-a (%8.3g) ;accelleration limit (inches/second^2)\n", amax);
+    fprintf(stderr, "-b (%8.3g) ;corner blending tolerance (inches)\n", btol);
     fprintf(stderr, "-f (%8.3g) ;stepper update frequency\n", fstep);
+    fprintf(stderr, "-j (%8.3g) ;junction deviation (inches)\n", jdev);
+    fprintf(stderr, "-J (%8.3g) ;jerk limit (inches/second^3)\n", jmax);
     fprintf(stderr, "-n (%8d) ;number of segments lookahead\n", nlook);
     fprintf(stderr, "-r (%8.3g) ;stepper step size (inches)\n", res);
     fprintf(stderr, "-v (%8.3g) ;velocity limit (inches/second)\n", vmax);
     fprintf(stderr, "\n");
+    for (i = 0; i < NAXIS; i++) {
+	fprintf(stderr, "%c: vmax %8.3g amax %8.3g res %8.3g invert %d\n",
+	    axis[i].name, axis[i].vmax, axis[i].amax, axis[i].res,
+	    axis[i].invert);
+    }
     fprintf(stderr, "%8.3g min step spacing (updates)\n", fstep/(vmax/res)); 
     }
 
-    if ((fstep/(vmax/res)) < MINSTEP) {
-        fprintf(stderr, "%s error: exceeded maximum allowable velocity\n",
-	argv[0]);
-        fprintf(stderr, 
-	    "min steps/update = (fstep*res)/(vmax) = %g (must be >= %g)\n",
-	    fstep/(vmax/res), MINSTEP);
-        exit(2); 
+    // each axis can't be stepped faster than MINSTEP updates apart,
+    // in full steps when the microsteps adapt to the speed
+
+    if (budget <= 0.0) {
+	interp = 1;
+    }
+    for (i = 0; i < NAXIS; i++) {
+	vv = min(vmax, axis[i].vmax);
+	if ((fstep/(vv/(interp*axis[i].res))) < MINSTEP) {
+	    fprintf(stderr, "%s error: exceeded maximum allowable velocity\n",
+	    prog);
+	    fprintf(stderr, 
+		"%c axis min steps/update = (fstep*res)/(vmax) = %g (must be >= %g)\n",
+		axis[i].name, fstep/(vv/(interp*axis[i].res)), MINSTEP);
+	    exit(2); 
+	}
+    }
+
+    xres = axis[0].res;
+    yres = axis[1].res;
+    zres = axis[2].res;
+    wres = axis[3].res;
+    return (rmin);
+}
+
+int main(int argc, char **argv)
+{
+    int done = 0;
+    int i;
+    double x0, y0, z0, w0;
+    double x1, y1, z1, w1;
+    double x2, y2, z2, w2;
+    double cosine;
+    double vv;
+    double ltotal = 0.0;
+    double ttotal = 0.0;
+    double vc, ac;
+    double rmin;
+    int k;
+
+    extern int optind;
+    int jargc, kind;
+    char **jargv;
+
+    if (options(argc, argv)) {
+	usage(argv[0]);
+    }
+    k = interp;			// setup() drops it without -u
+    rmin = setup(argv[0]);
+
+    // only a job comes back from the daemon, in a process of its own,
+    // with its input on stdin and stdout going where its plan goes
+
+    if (dname != NULL) {
+	kind = serve(dname, argv[0], &jargc, &jargv);
+	dname = NULL;
+	if (jargc > 1) {
+	    interp = k;
+	    optind = 1;
+	    if (options(jargc, jargv)) {
+		usage(argv[0]);
+	    }
+	    rmin = setup(argv[0]);
+	}
+	if (dname != NULL || latency >= 0 || (estimate && kind == JOB_RUN)) {
+	    fprintf(stderr, "%s error: a job can't use -D, -l or, run on the device, -e\n",
+		argv[0]);
+	    exit(1);
+	}
+    }
+
+    // streaming can't wait for the whole input, and the debug output
+    // isn't byte codes, so neither goes through the cache.  Nor does a
+    // traced plan, the trace comes from planning it.
+
+    fin = stdin;
+    if (cdir != NULL && latency < 0 && (debug&~32) == 0 && !estimate &&
+	tname == NULL) {
+	cachedplan(argv[0]);
+    }
+
+    // the index maps an input line to the byte offset of the motion
+    // following it and the machine state there, see feed -s
+
+    if (xname != NULL && !estimate) {
+	if ((xfile = fopen(xname, "w")) == NULL) {
+	    fprintf(stderr, "%s error: can't open %s\n", argv[0], xname);
+	    exit(1);
+	}
+	fprintf(xfile, "# res %g %g %g %g fstep %g mode %d\n", 
+	    xres, yres, zres, wres, fstep, umode);
+	fprintf(xfile, "# line offset xloc yloc zloc wloc dir mode vs\n");
+    }
+
+    if (tname != NULL) {
+	double h[5];
+
+	if ((tfile = fopen(tname, "w")) == NULL) {
+	    fprintf(stderr, "%s error: can't open %s\n", argv[0], tname);
+	    exit(1);
+	}
+	h[0] = fstep; h[1] = xres; h[2] = yres; h[3] = zres; h[4] = wres;
+	fwrite(TRACE_MAGIC, 4, 1, tfile);
+	fwrite(h, sizeof(h), 1, tfile);
+	if (tsteps && !estimate) {
+	    bc_trace(tfile);
+	}
     }
 
     getval();	// get first point
 
-    xloc = (int)round(d(1)->x/res);
-    yloc = (int)round(d(1)->y/res);
-    zloc = (int)round(d(1)->z/res);
-    wloc = (int)round(d(1)->w/res);
+    xloc = (int)round(d(1)->x/xres);
+    yloc = (int)round(d(1)->y/yres);
+    zloc = (int)round(d(1)->z/zres);
+    wloc = (int)round(d(1)->w/wres);
 
     for (i = 1; i < nlook - 1; i++) {	// fill buffer
 	getval();
     }
 
-    if (debug&4) {
-       fprintf(stderr,"MODE %.2x\n", mode&0x07);
+    if (estimate) {
+       ;
+    } else if (debug&4) {
+       fprintf(stderr,"MODE %.2x\n", umode&0x07);
     } else {
        // MODE    (7:0) '1010' 0mmm  ; set ustep mode
-       putchar(0xa0 | (mode & 0x07));
+       mode(umode);
     }
 
     while (!done) {
@@ -250,17 +956,19 @@ int main(int argc, char **argv)
 	// still be able to turn the next corner without exceeding
 	// the AMAX acceleration limit.
 
-        d(1)->x = (double)xloc * res;
-        d(1)->w = (double)wloc * res;
-        d(1)->y = (double)yloc * res;
-        d(1)->z = (double)zloc * res;
-	d(1)->l = sqrt(pow((d(1)->x - d(2)->x), 2.0) +
-			pow((d(1)->y - d(2)->y), 2.0) +
-			pow((d(1)->z - d(2)->z), 2.0) +
-			pow((d(1)->w - d(2)->w), 2.0) );
+        d(1)->x = (double)xloc * xres;
+        d(1)->w = (double)wloc * wres;
+        d(1)->y = (double)yloc * yres;
+        d(1)->z = (double)zloc * zres;
+	seglimits(d(1), d(2));
 
 	for (i = 2; i < nlook; i++) {
-	    if (d(i + 1)->eof == 1) {
+	    // limits common to both segments meeting at this node
+
+	    vc = min(d(i - 1)->vm, d(i)->vm);
+	    ac = min(d(i - 1)->am, d(i)->am);
+
+	    if (d(i + 1)->eof) {		// end of data or a pad
 		d(i)->vs = 0.0;
 	    } else {
 		x0 = d(i - 1)->x;
@@ -291,8 +999,16 @@ int main(int argc, char **argv)
 		               pow((z2 - z1), 2.0) +
 		               pow((w2 - w1), 2.0));
 
-		if (sqrt(2.0 - 2.0 * cosine) < (amax * res / vmax)) {
-		    d(i)->vs = vmax;
+		if (jdev > 0.0) {
+		    d(i)->vs = junction(cosine, ac, jdev, vc);
+		    if (debug&2)
+			fprintf(stderr,"3 vs = %g %g: %g %g %g %g, %g %g %g %g, %g %g %g %g\n",
+			     d(i)->vs, cosine, 
+			     x0, y0, z0, w0, 
+			     x1, y1, z1, w1, 
+			     x2, y2, z2, w2);
+		} else if (sqrt(2.0 - 2.0 * cosine) < (ac * rmin / vc)) {
+		    d(i)->vs = vc;
 		    if (debug&2)
 			fprintf(stderr,"1 vs = %g %g: %g %g %g %g, %g %g %g %g, %g %g %g %g\n",
 			     d(i)->vs, cosine, 
@@ -300,7 +1016,7 @@ int main(int argc, char **argv)
 			     x1, y1, z1, w1, 
 			     x2, y2, z2, w2);
 		} else {
-		    d(i)->vs = amax * res / sqrt(2.0 - 2.0 * cosine);
+		    d(i)->vs = ac * rmin / sqrt(2.0 - 2.0 * cosine);
 		    if (debug&2)
 			fprintf(stderr,"2 vs = %g %g: %g %g %g %g, %g %g %g %g, %g %g %g %g\n",
 			     d(i)->vs, cosine, 
@@ -308,6 +1024,13 @@ int main(int argc, char **argv)
 			     x1, y1, z1, w1, 
 			     x2, y2, z2, w2);
 		}
+
+		// blended arc points are limited by the centripetal
+		// acceleration on the arc, not by the chord bend
+
+		if (d(i)->r > 0.0) {
+		    d(i)->vs = min(vc, sqrt(ac * d(i)->r));
+		}
 	    }
 	}
 
@@ -317,18 +1040,20 @@ int main(int argc, char **argv)
 	// V = V0 + A*t
 	// L = V0*t + A*t^2/2
 	// V(L) = sqrt(V0^2 + 2*A*L);
+	//
+	// or with a jerk limit the S-curve equivalent, see profile.c
 
 	for (i = nlook - 1; i > 1; i--) {	// backwards chaining
-	    vv = sqrt(pow(d(i + 1)->vs, 2.0) + 2.0 * amax * d(i)->l);
+	    vv = profile_reach(d(i + 1)->vs, d(i)->am, jmax, d(i)->l);
 	    if (debug&8)
 		fprintf(stderr,"di+1vs=%g divs=%g vv==%g\n", d(i + 1)->vs,
 		       d(i)->vs, vv);
 	    d(i)->vs = min(d(i)->vs, vv);
-	    d(i)->vs = min(d(i)->vs, vmax);
+	    d(i)->vs = min(d(i)->vs, d(i)->vm);
 	}
 
 	// forward chaining 
-	vv = sqrt(pow(d(1)->vs, 2.0) + 2.0 * amax * d(1)->l);
+	vv = profile_reach(d(1)->vs, d(1)->am, jmax, d(1)->l);
 	d(2)->vs = min(d(2)->vs, vv);
 
 	if (debug&8) {
@@ -340,29 +1065,91 @@ int main(int argc, char **argv)
 	    }
 	}
 
-	len = sqrt(pow(((double)xloc*res - d(2)->x), 2.0) +
-	           pow(((double)yloc*res - d(2)->y), 2.0) +
-	           pow(((double)zloc*res - d(2)->z), 2.0) +
-	           pow(((double)wloc*res - d(2)->w), 2.0));
+	// a pad target means we are stopped waiting for input
 
+	if (d(2)->eof != 2 && estimate) {
+	    equeue(d(1), d(2));
+	    if (ebatch.n == EBATCH) {
+		ttotal += eflush(rmin, ttotal);
+	    }
+	} else if (d(2)->eof != 2) {
+	    // initialize velocity calculation code
+	    setseg(d(i)->l, d(i)->vs,d(i+1)->vs,d(i)->vm,d(i)->am,jmax,rmin, fstep);
 
-	// initialize velocity calculation code
-	setseg(d(i)->l, d(i)->vs,d(i+1)->vs,vmax,amax,res, fstep);
-	//setseg(len, d(1)->vs,d(2)->vs,vmax,amax,res, fstep);
+	    k = 1;
+	    if (budget > 0.0) {
+		k = stepmode(segprofile()->vm[0], d(2), d(3), rmin);
 
-	ttotal+=interpolate((double)xloc*res,   (double)yloc*res,   (double)zloc*res,   (double)wloc*res, 
-	                    d(2)->x, d(2)->y, d(2)->z, d(2)->w, ttotal, ltotal);
+		// only a start from rest (the first move, or after a
+		// stop) can be off the grid: nudge onto it first
+
+		if (!aligned(k, xloc, yloc, zloc, wloc)) {
+		    ttotal += nudge(round((double)xloc/k)*k*xres, round((double)yloc/k)*k*yres,
+				    round((double)zloc/k)*k*zres, round((double)wloc/k)*k*wres, rmin);
+		    setseg(d(i)->l, d(i)->vs,d(i+1)->vs,d(i)->vm,d(i)->am,jmax,rmin, fstep);
+		}
+		setscale(k);
+		rescale(k);
+	    }
+	    if (tfile != NULL) {
+		traceseg(segprofile(), 0, d(2)->line, ttotal);
+	    }
+
+	    if (idda) {
+		ttotal+=dda(segprofile(), (int)round(d(2)->x/xres),
+			    (int)round(d(2)->y/yres), (int)round(d(2)->z/zres),
+			    (int)round(d(2)->w/wres), fstep);
+	    } else {
+		ttotal+=interpolate((double)xloc*xres, (double)yloc*yres, (double)zloc*zres, (double)wloc*wres, 
+				    d(2)->x, d(2)->y, d(2)->z, d(2)->w, ttotal, ltotal);
+	    }
+	    unscale(k);
+	    if (k > 1 && d(3)->eof) {
+		ttotal += nudge(tail[0], tail[1], tail[2], tail[3], rmin);
+	    }
+
+	    if (xfile != NULL && d(2)->line > 0) {
+		fprintf(xfile, "%d %ld %d %d %d %d 0x%.2x %d %g\n",
+		    d(2)->line, bc_tell(), xloc, yloc, zloc, wloc,
+		    bc_dir(), interp2mode(interp / sk), d(2)->vs);
+	    }
+	}
 
         //fprintf(stderr,"(%g) (%g) (%g) (%g)\n",
-	//      d(2)->x - ((double) xloc)*res,
-	//      d(2)->y - ((double) yloc)*res,
-	//      d(2)->z - ((double) zloc)*res,
-	//      d(2)->w - ((double) wloc)*res);
+	//      d(2)->x - ((double) xloc)*xres,
+	//      d(2)->y - ((double) yloc)*yres,
+	//      d(2)->z - ((double) zloc)*zres,
+	//      d(2)->w - ((double) wloc)*wres);
 
 	ltotal+=d(1)->l;
 
 	if (d(3)->eof == 1)
 	    done++;
     }
+
+    if (estimate) {
+	ttotal += eflush(rmin, ttotal);
+    }
+    if (debug&32) {
+	fprintf(stderr, "length %g time %g\n", ltotal, ttotal);
+    }
+    if (estimate) {
+	printf("length %g time %g\n", ltotal, ttotal);
+	printf("accel %g cruise %g decel %g\n", tacc, tcru, tdec);
+	for (i = 0; i < NSLOW && slowline[i] != 0; i++) {
+	    printf("slow line %d length %g time %g lost %g\n", 
+		slowline[i], slowlen[i], slowtime[i], slowlost[i]);
+	}
+    }
+    if (xfile != NULL) {
+	fclose(xfile);
+    }
+    if (tfile != NULL) {
+	fclose(tfile);
+    }
+    if (ctee != NULL) {
+	fflush(stdout);
+	cache_done(cdir, cdkey, ctee, xname);
+    }
 }
 
@@ -0,0 +1,344 @@
+#define _GNU_SOURCE		// mkostemp()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+//
+// run many velo jobs at once.  Each manifest line is
+//
+//	<input> <output> [velo options]
+//
+// and the jobs are dealt out in equal runs to a pool of worker
+// threads.  Each worker takes from the front of its own run; one that
+// runs dry steals the back half of the longest run left, so a few
+// slow jobs don't hold up the batch.  velo keeps its planner state in
+// globals, so every job runs in its own velo process rather than in
+// the worker thread.  The output is written to a temporary name and
+// renamed into place only if velo succeeded, so a failed or
+// interrupted job never leaves a short file behind.
+//
+
+#define MAXJOBS 10000		// most jobs in a manifest
+#define MAXARGS 32		// most velo options per job
+#define MAXLINE 1024
+
+typedef struct job {
+    char *in;			// path input
+    char *out;			// byte code output
+    char *argv[MAXARGS + 2];	// velo command line
+    int status;			// velo exit status
+    int errors;			// lines velo complained about
+    long bytes;			// output size
+    double t;			// wall clock time
+} JOB;
+
+typedef struct queue {
+    pthread_mutex_t lock;
+    int lo, hi;			// jobs[lo..hi-1] still to run
+} QUEUE;
+
+JOB jobs[MAXJOBS];
+int njobs = 0;
+QUEUE *queues;			// one per worker
+int nqueue = 0;
+int nsteal = 0;
+int nfail = 0;
+long nbytes = 0;
+char *velo = "velo";
+int debug = 0;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec + t.tv_nsec * 1e-9);
+}
+
+// read the manifest into jobs[], returns the number of bad lines
+
+int manifest(FILE *f)
+{
+    char line[MAXLINE];
+    char *s, *tok;
+    int bad = 0;
+    int n, k, i;
+    JOB j;
+
+    for (n = 1; fgets(line, MAXLINE, f) != NULL; n++) {
+	if ((s = strchr(line, '#')) != NULL) {
+	    *s = '\0';
+	}
+	memset(&j, 0, sizeof(j));
+	j.argv[0] = velo;
+	k = 0;
+	for (tok = strtok(line, " \t\n"); tok != NULL; tok = strtok(NULL, " \t\n")) {
+	    if (k == 0) {
+		j.in = strdup(tok);
+	    } else if (k == 1) {
+		j.out = strdup(tok);
+	    } else if (k - 1 <= MAXARGS) {
+		j.argv[k - 1] = strdup(tok);
+	    }
+	    k++;
+	}
+	if (k == 0) {
+	    continue;
+	}
+	if (k < 2 || k - 1 > MAXARGS || njobs == MAXJOBS) {
+	    fprintf(stderr, "manifest line %d: bad job\n", n);
+	    bad++;
+	    free(j.in);
+	    free(j.out);
+	    for (i = 1; i <= MAXARGS; i++) {
+		free(j.argv[i]);
+	    }
+	    continue;
+	}
+	j.argv[k - 1] = NULL;
+	jobs[njobs++] = j;
+    }
+    return (bad);
+}
+
+// run one job: velo < in > out.tmp, then rename out.tmp to out
+
+void run(JOB *j)
+{
+    char tmp[MAXLINE + 32];
+    char err[32];
+    char line[MAXLINE];
+    struct stat st;
+    FILE *fe;
+    pid_t pid;
+    int in, out, efd;
+    double t0 = now();
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp%d", j->out, getpid());
+
+    j->status = -1;
+    // O_CLOEXEC: the other workers fork too, and their velo must not
+    // hold our output open past the rename
+
+    if ((in = open(j->in, O_RDONLY | O_CLOEXEC)) < 0) {
+	j->errors = 1;
+	j->t = now() - t0;
+	return;
+    }
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    strcpy(err, "/tmp/velobatchXXXXXX");	// velo's stderr, unlinked
+    if ((efd = mkostemp(err, O_CLOEXEC)) >= 0) {
+	unlink(err);
+    }
+    if (out < 0 || efd < 0) {
+	close(in);
+	if (out >= 0) close(out);
+	if (efd >= 0) close(efd);
+	j->errors = 1;
+	j->t = now() - t0;
+	return;
+    }
+
+    if ((pid = fork()) == 0) {
+	dup2(in, 0);
+	dup2(out, 1);
+	dup2(efd, 2);
+	execvp(velo, j->argv);
+	fprintf(stderr, "error: can't run %s\n", velo);
+	_exit(127);
+    }
+    close(in);
+    close(out);
+    if (pid < 0 || waitpid(pid, &j->status, 0) < 0) {
+	j->status = -1;
+    }
+
+    // count the errors velo reported
+
+    j->errors = 0;
+    lseek(efd, 0, SEEK_SET);
+    if ((fe = fdopen(efd, "r")) != NULL) {
+	while (fgets(line, sizeof(line), fe) != NULL) {
+	    if (strstr(line, "error") != NULL) {
+		j->errors++;
+	    }
+	}
+	fclose(fe);
+    } else {
+	close(efd);
+    }
+
+    if (j->status == 0 && stat(tmp, &st) == 0 && rename(tmp, j->out) == 0) {
+	j->bytes = st.st_size;
+    } else {
+	unlink(tmp);
+	if (j->status == 0) {
+	    j->status = -1;
+	}
+    }
+    j->t = now() - t0;
+}
+
+// take the next job for worker id: the front of its own run, else
+// the back half of the longest run left.  Returns -1 when all are gone.
+
+int take(int id)
+{
+    QUEUE *q = &queues[id];
+    QUEUE *v;
+    int i, k, n, hi;
+
+    pthread_mutex_lock(&q->lock);
+    k = (q->lo < q->hi) ? q->lo++ : -1;
+    pthread_mutex_unlock(&q->lock);
+    while (k < 0) {
+	v = NULL;
+	n = 0;
+	for (i = 0; i < nqueue; i++) {
+	    if (i != id && queues[i].hi - queues[i].lo > n) {	// racy, rechecked below
+		v = &queues[i];
+		n = v->hi - v->lo;
+	    }
+	}
+	if (v == NULL) {
+	    return (-1);
+	}
+	pthread_mutex_lock(&v->lock);
+	n = (v->hi - v->lo) / 2;
+	hi = v->hi;
+	v->hi -= n;
+	if (n == 0 && v->lo < v->hi) {	// last one, take it
+	    k = --v->hi;
+	}
+	pthread_mutex_unlock(&v->lock);
+	if (n > 0) {
+	    pthread_mutex_lock(&q->lock);
+	    q->lo = hi - n;
+	    q->hi = hi;
+	    k = q->lo++;
+	    pthread_mutex_unlock(&q->lock);
+	}
+	if (k >= 0) {
+	    pthread_mutex_lock(&lock);
+	    nsteal++;
+	    pthread_mutex_unlock(&lock);
+	}
+    }
+    return (k);
+}
+
+// worker thread: run jobs until there are none left
+
+void *worker(void *arg)
+{
+    int id = (int) (long) arg;
+    JOB *j;
+    int k;
+
+    while ((k = take(id)) >= 0) {
+	j = &jobs[k];
+	run(j);
+
+	pthread_mutex_lock(&lock);
+	if (j->status != 0) {
+	    nfail++;
+	}
+	nbytes += j->bytes;
+	printf("%s %s %s time %.3f bytes %ld errors %d\n",
+	    (j->status == 0) ? "ok" : "FAIL", j->in, j->out,
+	    j->t, j->bytes, j->errors);
+	fflush(stdout);
+	pthread_mutex_unlock(&lock);
+    }
+    return (NULL);
+}
+
+int main(int argc, char **argv)
+{
+    extern int optind;
+    extern char *optarg;
+    int errflg = 0;
+    int nthread = 0;
+    int bad;
+    int c, i;
+    pthread_t *tid;
+    FILE *f = stdin;
+    double t0;
+
+    while ((c = getopt(argc, argv, "d:j:p:")) != EOF) {
+	switch (c) {
+	case 'd':
+	    debug = atoi(optarg);
+	    break;
+	case 'j':			// worker threads
+	    nthread = atoi(optarg);
+	    break;
+	case 'p':			// velo program
+	    velo = optarg;
+	    break;
+	default:
+	    errflg = 1;
+	    break;
+	}
+    }
+
+    if (errflg || optind < argc - 1) {
+	fprintf(stderr, "usage: %s [options] [manifest]\n", argv[0]);
+	fprintf(stderr, "     manifest lines are: <input> <output> [velo options]\n");
+	fprintf(stderr, "     -d <debug> ; verbose debugging\n");
+	fprintf(stderr, "     -j <n>     ; run n jobs at once (default one per core)\n");
+	fprintf(stderr, "     -p <velo>  ; velo program to run (default velo)\n");
+	exit(1);
+    }
+
+    if (optind < argc && (f = fopen(argv[optind], "r")) == NULL) {
+	fprintf(stderr, "%s error: can't open %s\n", argv[0], argv[optind]);
+	exit(1);
+    }
+    bad = manifest(f);
+
+    if (nthread <= 0) {
+	nthread = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthread > njobs) {
+	nthread = njobs;
+    }
+    if (debug) {
+	fprintf(stderr, "%d jobs on %d threads\n", njobs, nthread);
+    }
+
+    // deal the jobs out in equal runs
+
+    queues = (QUEUE *) malloc((nthread + 1) * sizeof(QUEUE));
+    nqueue = nthread;
+    for (i = 0; i < nthread; i++) {
+	pthread_mutex_init(&queues[i].lock, NULL);
+	queues[i].lo = (long) njobs * i / nthread;
+	queues[i].hi = (long) njobs * (i + 1) / nthread;
+    }
+
+    t0 = now();
+    tid = (pthread_t *) malloc((nthread + 1) * sizeof(pthread_t));
+    for (i = 0; i < nthread; i++) {
+	pthread_create(&tid[i], NULL, worker, (void *) (long) i);
+    }
+    for (i = 0; i < nthread; i++) {
+	pthread_join(tid[i], NULL);
+    }
+
+    if (debug) {
+	fprintf(stderr, "%d steals\n", nsteal);
+    }
+    printf("jobs %d failed %d time %.3f bytes %ld\n",
+	njobs, nfail + bad, now() - t0, nbytes);
+    exit((nfail + bad) ? 2 : 0);
+}
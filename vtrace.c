@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "trace.h"
+
+//
+// read a velo -T motion trace and print it as columns for plotting,
+// one line per segment (or per step with -p), or with -s a summary
+// of where the job time goes:
+//
+//	velo -T job.tr < job.xy > job.bc
+//	vtrace -s job.tr
+//
+
+#define NWORST 100		// most slow segments to list
+
+double fstep;
+int perstep = 0;
+int summary = 0;
+int nworst = 5;
+
+// summary tallies
+
+long nseg = 0;
+long nslow = 0;			// segments that never reach their limit
+double ltotal = 0.0;
+double ttotal = 0.0;
+double tacc = 0.0, tcru = 0.0, tdec = 0.0;
+double tlost = 0.0;		// time behind cruising at the limit
+long nstep = 0;
+long nphase[5];			// steps in each phase
+long minsp = -1;		// closest step spacing (ticks)
+unsigned int lasttick = 0;
+TRACESEG worst[NWORST];		// segments losing the most time
+int nw = 0;
+
+// steps of the current segment, held until its end tick is known
+
+unsigned int *stick = NULL;
+unsigned char *smask = NULL;
+long ns = 0, nsmax = 0;
+
+char *phasename[] = { "", "", "accel", "cruise", "decel" };
+
+double lost(TRACESEG *r)
+{
+    return (r->t - r->l / r->vlim);
+}
+
+// keep the nworst segments that lose the most time, worst first
+
+void keep(TRACESEG *r)
+{
+    int i;
+
+    if (nworst <= 0 || (nw == nworst && lost(r) <= lost(&worst[nw - 1]))) {
+	return;
+    }
+    if (nw < nworst) {
+	nw++;
+    }
+    for (i = nw - 1; i > 0 && lost(&worst[i - 1]) < lost(r); i--) {
+	worst[i] = worst[i - 1];
+    }
+    worst[i] = *r;
+}
+
+// phase of a step at tick in segment r, which ran until tick end.
+// Every step costs the firmware a tick on top of the delays, so the
+// segment can run longer than planned; the time into it is scaled to
+// the plan before it is held against ts1 and ts2.
+
+int phase(TRACESEG *r, unsigned int tick, unsigned int end)
+{
+    double t = (double) (tick - r->tick) / fstep;
+
+    if (end > r->tick) {
+	t *= r->t * fstep / (end - r->tick);
+    }
+
+    if (t < r->ts1) {
+	return (ACCEL);
+    } else if (t < r->ts2) {
+	return (CRUISE);
+    }
+    return (DECEL);
+}
+
+void segment(TRACESEG *r)
+{
+    nseg++;
+    ltotal += r->l;
+    ttotal += r->t;
+    tacc += r->ts1;
+    tcru += r->ts2 - r->ts1;
+    tdec += r->t - r->ts2;
+    if (r->vlim > 0.0) {
+	tlost += lost(r);
+	if (r->vm < r->vlim * 0.999) {
+	    nslow++;
+	}
+	keep(r);
+    }
+    if (!summary && !perstep) {
+	printf("%.6f %d %g %g %g %g %g %g %g %g %g %g\n",
+	    r->t0, r->line, r->l, r->vlim, r->amax, r->vs, r->vm, r->ve,
+	    r->ts1, r->ts2, r->t, (r->vlim > 0.0) ? lost(r) : 0.0);
+    }
+}
+
+void stepped(TRACESEG *r, int mask, unsigned int tick, unsigned int end)
+{
+    int ph = phase(r, tick, end);
+
+    if (nstep > 0 && (minsp < 0 || tick - lasttick < minsp)) {
+	minsp = tick - lasttick;
+    }
+    nstep++;
+    nphase[ph]++;
+    if (perstep) {
+	printf("%.6f %u 0x%.2x %d %s %g\n", tick / fstep, tick, mask,
+	    r->line, phasename[ph],
+	    (nstep > 1 && tick > lasttick) ? fstep / (tick - lasttick) : 0.0);
+    }
+    lasttick = tick;
+}
+
+// run the steps held for segment r, now that it is known to end at
+// tick end
+
+void flush(TRACESEG *r, unsigned int end)
+{
+    long i;
+
+    for (i = 0; i < ns; i++) {
+	stepped(r, smask[i], stick[i], end);
+    }
+    ns = 0;
+}
+
+void hold(int mask, unsigned int tick)
+{
+    if (ns == nsmax) {
+	nsmax = nsmax ? 2 * nsmax : 4096;
+	stick = (unsigned int *) realloc(stick, nsmax * sizeof(*stick));
+	smask = (unsigned char *) realloc(smask, nsmax);
+	if (stick == NULL || smask == NULL) {
+	    fprintf(stderr, "vtrace: out of memory\n");
+	    exit(1);
+	}
+    }
+    stick[ns] = tick;
+    smask[ns++] = mask;
+}
+
+int main(int argc, char **argv)
+{
+    extern int optind;
+    extern char *optarg;
+    int errflg = 0;
+    int c, mask, i;
+    unsigned int tick;
+    char magic[4];
+    double h[5];
+    TRACESEG r, next;
+    FILE *f = stdin;
+
+    memset(&r, 0, sizeof(r));
+    while ((c = getopt(argc, argv, "n:ps")) != EOF) {
+	switch (c) {
+	case 'n':			// slow segments to list
+	    nworst = atoi(optarg);
+	    break;
+	case 'p':			// a line per step
+	    perstep = 1;
+	    break;
+	case 's':			// summary
+	    summary = 1;
+	    break;
+	default:
+	    errflg = 1;
+	    break;
+	}
+    }
+    if (errflg || optind < argc - 1 || nworst > NWORST) {
+	fprintf(stderr, "usage: %s [options] [trace]\n", argv[0]);
+	fprintf(stderr, "     -n <n>     ; list the n slowest segments (default 5, max %d)\n", NWORST);
+	fprintf(stderr, "     -p         ; a line per step (velo -t)\n");
+	fprintf(stderr, "     -s         ; summary only\n");
+	fprintf(stderr, "     segment columns: t0 line l vlim amax vs vm ve ts1 ts2 t lost\n");
+	fprintf(stderr, "     step columns: t tick mask line phase rate\n");
+	exit(1);
+    }
+    if (optind < argc && (f = fopen(argv[optind], "r")) == NULL) {
+	fprintf(stderr, "%s error: can't open %s\n", argv[0], argv[optind]);
+	exit(1);
+    }
+    if (fread(magic, 4, 1, f) != 1 || memcmp(magic, TRACE_MAGIC, 4) != 0 ||
+	fread(h, sizeof(h), 1, f) != 1) {
+	fprintf(stderr, "%s error: not a velo trace\n", argv[0]);
+	exit(1);
+    }
+    fstep = h[0];		// then the axis resolutions
+
+    while ((c = getc(f)) != EOF) {
+	if (c == TRACE_SEG && fread(&next, sizeof(next), 1, f) == 1) {
+	    flush(&r, next.tick);
+	    r = next;
+	    segment(&r);
+	} else if (c == TRACE_STEP && (mask = getc(f)) != EOF &&
+	    fread(&tick, sizeof(tick), 1, f) == 1) {
+	    hold(mask, tick);
+	} else {
+	    fprintf(stderr, "%s error: bad record after %ld segments\n",
+		argv[0], nseg);
+	    exit(1);
+	}
+    }
+
+    flush(&r, (ns > 0) ? stick[ns - 1] + 1 : r.tick);
+
+    if (summary) {
+	printf("segments %ld length %g time %g\n", nseg, ltotal, ttotal);
+	printf("accel %g cruise %g decel %g\n", tacc, tcru, tdec);
+	printf("lost %g in %ld segments short of their limit\n", tlost, nslow);
+	for (i = 0; i < nw; i++) {
+	    printf("slow line %d length %g vlim %g vm %g time %g lost %g\n",
+		worst[i].line, worst[i].l, worst[i].vlim, worst[i].vm,
+		worst[i].t, lost(&worst[i]));
+	}
+	if (nstep > 0) {
+	    printf("steps %ld accel %ld cruise %ld decel %ld\n", nstep,
+		nphase[ACCEL], nphase[CRUISE], nphase[DECEL]);
+	    printf("last step %g s (planned %g), closest steps %ld ticks\n",
+		lasttick / fstep, ttotal, minsp);
+	}
+    }
+    exit(0);
+}